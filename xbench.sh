@@ -0,0 +1,38 @@
+#!/bin/sh
+# Benchmark xcheck over the given images with each mapping/arena option
+# and each reference counting engine, then sweep the engines over the images
+# by ninodes to find where the sort engine overtakes the array engine on a
+# host. The harness cannot make images of a given ninodes itself, as mkfs
+# fixes NINODES when it is built, so the sweep only covers the images it is
+# given. Dirents hold 16 bit inums, so past 65536 inodes the counts stop
+# growing: a host whose L2 cache holds 256 KiB of counts shows no crossover.
+# usage: ./xbench.sh [xv6 filesystem image]...
+
+if [ $# -eq 0 ]; then
+    echo "usage: xbench.sh [xv6 filesystem image]..."
+    exit 1
+fi
+
+for img in "$@"; do
+    for opt in "" "-p" "-m" "-H" "-p -m -H" "--refs=array" "--refs=sort"; do
+        printf '%s %-14s ' "$img" "${opt:-default}"
+        # Drop the image from the page cache when allowed, so that major
+        # faults show up as well
+        sync; { echo 1 > /proc/sys/vm/drop_caches; } 2>/dev/null
+        ./xcheck -s $opt "$img" | tail -n 1
+    done
+done
+
+echo "ninodes array sort"
+for img in "$@"; do
+    # ninodes is the fourth word of the superblock in block 1
+    printf '%s ' "$(od -An -tu4 -j 1036 -N 4 "$img" | tr -d ' ')"
+    echo "$img"
+done | sort -n | while read ninodes img; do
+    printf '%-7s' "$ninodes"
+    for refs in array sort; do
+        sync; { echo 1 > /proc/sys/vm/drop_caches; } 2>/dev/null
+        printf ' %s' "$(./xcheck -s --refs=$refs "$img" | tail -n 1 | cut -d ' ' -f 2)"
+    done
+    printf ' ms %s\n' "$img"
+done
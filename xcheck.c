@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -5,15 +7,446 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <math.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #include "xv6-riscv/kernel/fs.h"
 #include "xv6-riscv/kernel/param.h"
 #include "xv6-riscv/kernel/types.h"
 
-#define die(msg) do { fprintf(stderr, "ERROR: %s\n", msg); exit(1); } while (0)
+#include "xindex.h"
+#include "xcheckd.h"
+
+void finish(int status);
+
+#define die(msg) do { fprintf(stderr, "ERROR: %s\n", msg); finish(1); } while (0)
+
+// Bump whenever a check or the output of xcheck changes, it keys the cache
+#define XCHECK_VERSION 2
+
+#define HUGESZ (2UL << 20)
+
+/*
+ * Command line options
+ */
+struct xopts {
+    int repair;      // -r: repair flag
+    int populate;    // -p: prefault the image mapping with MAP_POPULATE
+    int advise;      // -m: MADV_HUGEPAGE/MADV_SEQUENTIAL on inode table and bitmap
+    int huge_arena;  // -H: tracking arrays from a huge-page-backed arena
+    int stats;       // -s: report time and page faults of the run
+    char *emit_index; // --emit-index: write the metadata index here
+    int space;       // --space: report space usage and fragmentation
+    int level;       // -l: checks to run, see below
+    char *cache_dir; // -c: result cache directory
+    int refs;        // --refs: reference counting engine, REFS_*
+    struct arena *arena; // tracking arena kept across checks, NULL for one per check
+    double sample;   // --sample: percent of the inodes in use to check, 0 for all
+    unsigned long seed; // --seed: seed of the sample
+    struct xchain *chain; // --chain: results kept from the previous image, NULL outside a chain
+};
+
+/*
+ * Reference counting engines
+ * The array engine increments a count per inode for every dirent, the sort
+ * engine appends the inums to a buffer and counts them after a radix sort,
+ * which trades random increments for sequential passes once the counts no
+ * longer fit in cache. REFS_AUTO picks one from the size of the counts.
+ */
+#define REFS_AUTO  0
+#define REFS_ARRAY 1
+#define REFS_SORT  2
+
+/*
+ * Check levels, each including the ones before it
+ * 1: superblock and root directory (#1, #2)
+ * 2: inode types, addresses and sizes (#3, #4, #5, #9)
+ * 3: directory format (#6)
+ * 4: bitmap and reference counts (#7, #8), the default
+ */
+#define LEVEL_SUPER  1
+#define LEVEL_INODES 2
+#define LEVEL_DIRS   3
+#define LEVEL_FULL   4
+
+/*
+ * A mapped filesystem image and the hole map of its file
+ */
+struct ximage {
+    void *map;
+    off_t size;
+    uint8 *holes;
+    uint nholes;
+};
+
+/*
+ * Bump allocator for the tracking arrays of a check
+ * The memory comes from a single anonymous mapping, which is zero-filled,
+ * so the arrays need no memset and pages are only faulted in when touched.
+ */
+struct arena {
+    char *base;
+    size_t size;
+    size_t used;
+};
+
+#define DPB (BSIZE / sizeof(struct dirent))
+
+/*
+ * Block map layout of a dinode
+ * The first ndirect addresses are direct, the next one is the indirect
+ * block, and kernels with large files add a double-indirect block, whose
+ * addresses are indirect blocks, after it. The layout follows the dinode of
+ * fs.h, and --dindirect makes its last address the double-indirect block
+ * for images of such kernels built with a stock fs.h.
+ */
+#define NADDRS (sizeof(((struct dinode *)0)->addrs) / sizeof(uint))
+#define XMAXFILE (NDIRECT + NINDIRECT + NINDIRECT * NINDIRECT)
+
+struct xbmap {
+    uint ndirect;
+    uint dindirect; // address of the double-indirect block, 0 for none
+};
+
+static struct xbmap bmap = { NDIRECT, NADDRS > NDIRECT + 1 ? NDIRECT + 1 : 0 };
+
+/*
+ * Parent index entry
+ * Where the dirent referring to an inode was found: the directory inode and
+ * the slot of the dirent, which is its block address times DPB plus its index
+ * in the block. A parent of 0 means no dirent refers to the inode.
+ */
+struct pent {
+    uint parent;
+    uint slot;
+};
+
+/*
+ * Dirent reference recorded by the chain mode in pass order
+ */
+struct dref {
+    uint inum;
+    struct pent p;
+};
+
+/*
+ * Results of the per-inode checks of one inode table block, kept by the
+ * chain mode for reuse on the next images. key hashes the inode table block
+ * with the indirect and directory blocks of its inodes, and the results
+ * hold for any image with the same key and superblock. blks holds, for every
+ * inode in use, its inum, the number of addresses it claims and those
+ * addresses in the order the walkers claimed them, the ones checked as
+ * direct addresses tagged with CLAIM_DIRECT. refs holds the dirents of its
+ * directories in the order they were counted.
+ */
+#define CLAIM_DIRECT 0x80000000u
+
+struct xgroup {
+    uint64_t key;
+    uint valid;     // the inodes passed their checks
+    uint *blks;
+    uint nblks, blkcap;
+    struct dref *refs;
+    uint nrefs, refcap;
+};
+
+/*
+ * Chain mode state, the results of every inode table block as of the last
+ * image it was checked on
+ */
+struct xchain {
+    uint64_t sbkey;
+    int level;
+    uint ngroups;
+    struct xgroup *groups;
+    uint used;      // inode table blocks in use in the last image
+    uint reused;    // and those of them whose results were reused
+};
+
+/*
+ * Per-inode check state
+ * The image and tracking arrays that the address walkers below need, so that
+ * every walker can do the bounds, ownership and dirent checks for an address
+ * in the same pass that fetches it.
+ */
+struct xstate {
+    void *map;
+    struct superblock *sb;
+    uint blockstart;
+    uint64_t *block_used;
+    uint *inode_used;
+    uint *inode_refd;
+    struct pent *parents;
+    uint8 *holes;
+    uint nholes;
+    uint scanned;   // inodes before this one are in the parent index, with the array engine
+    char **paths;   // memoised paths, allocated on the first diagnostic
+    uint *runs;     // contiguous runs of data blocks per inode, for --space
+    uint *drefs;    // inums referred to, for the sort engine, NULL with the array engine
+    uint ndrefs;
+    uint drefcap;
+    jmp_buf *trap;  // set while sampling, a failed inode returns here
+    struct xgroup *log; // set to record the claims and references of the walkers
+};
+
+/*
+ * Whether block addr lies entirely in a hole of the image file. Holes read
+ * as zeros, so such a block is known to be all-zero without touching it.
+ */
+static inline int is_hole(struct xstate *st, uint addr) {
+    return st->holes && addr < st->nholes && st->holes[addr];
+}
+
+/*
+ * Block sets are bitsets of 64 bit words laid out like the on-disk bitmap:
+ * block b is bit b % 64 of word b / 64.
+ */
+static inline int test_block(uint64_t *set, uint b) {
+    return (set[b / 64] >> (b % 64)) & 1;
+}
+
+static inline void set_block(uint64_t *set, uint b) {
+    set[b / 64] |= 1ULL << (b % 64);
+}
+
+/*
+ * Count the blocks of set in [from, to) a word at a time.
+ */
+static uint count_blocks(uint64_t *set, uint from, uint to) {
+    uint n = 0;
+    for (uint w = from / 64; w * 64 < to; ++w) {
+        uint64_t word = set[w];
+        if (w == from / 64) {
+            word &= ~0ULL << (from % 64);
+        }
+        if (to - w * 64 < 64) {
+            word &= (1ULL << (to - w * 64)) - 1;
+        }
+        n += __builtin_popcountll(word);
+    }
+    return n;
+}
+
+/*
+ * Find the first block in [from, to) whose bit in set equals val, or to if
+ * there is none, skipping whole words that cannot hold it.
+ */
+static uint next_block(uint64_t *set, uint from, uint to, int val) {
+    if (from >= to) {
+        return to;
+    }
+    uint64_t flip = val ? 0 : ~0ULL;
+    uint w = from / 64;
+    uint64_t word = (set[w] ^ flip) & (~0ULL << (from % 64));
+    while (word == 0) {
+        if (++w * 64 >= to) {
+            return to;
+        }
+        word = set[w] ^ flip;
+    }
+    uint b = w * 64 + __builtin_ctzll(word);
+    return b < to ? b : to;
+}
+
+/*
+ * Append a reference to the sort engine buffer, growing it as needed.
+ */
+static void grow_drefs(struct xstate *st) {
+    st->drefcap = st->drefcap ? 2 * st->drefcap : 4096;
+    st->drefs = realloc(st->drefs, st->drefcap * sizeof(uint));
+    if (!st->drefs) {
+        printf("reference buffer allocation failed\n");
+        exit(1);
+    }
+}
+
+static inline void add_dref(struct xstate *st, uint inum) {
+    if (st->ndrefs == st->drefcap) {
+        grow_drefs(st);
+    }
+    st->drefs[st->ndrefs++] = inum;
+}
+
+/*
+ * Append a claimed address or a dirent reference to the results of an inode
+ * table block.
+ */
+static void push_blk(struct xgroup *grp, uint b) {
+    if (grp->nblks == grp->blkcap) {
+        grp->blkcap = grp->blkcap ? 2 * grp->blkcap : 64;
+        grp->blks = realloc(grp->blks, grp->blkcap * sizeof(uint));
+        if (!grp->blks) {
+            printf("chain allocation failed\n");
+            exit(1);
+        }
+    }
+    grp->blks[grp->nblks++] = b;
+}
+
+static void push_ref(struct xgroup *grp, struct dref r) {
+    if (grp->nrefs == grp->refcap) {
+        grp->refcap = grp->refcap ? 2 * grp->refcap : 64;
+        grp->refs = realloc(grp->refs, grp->refcap * sizeof(struct dref));
+        if (!grp->refs) {
+            printf("chain allocation failed\n");
+            exit(1);
+        }
+    }
+    grp->refs[grp->nrefs++] = r;
+}
+
+/*
+ * Sort n keys below limit with an LSD radix sort of 8 bit digits, using tmp
+ * as scratch space. Only as many digits as limit needs are sorted.
+ */
+static void radix_sort(uint *keys, uint *tmp, uint n, uint limit) {
+    for (uint shift = 0; shift < 32 && (limit - 1) >> shift; shift += 8) {
+        uint count[257] = {0};
+        for (uint k = 0; k < n; ++k) {
+            count[((keys[k] >> shift) & 0xff) + 1]++;
+        }
+        for (uint d = 0; d < 256; ++d) {
+            count[d + 1] += count[d];
+        }
+        for (uint k = 0; k < n; ++k) {
+            tmp[count[(keys[k] >> shift) & 0xff]++] = keys[k];
+        }
+        memcpy(keys, tmp, n * sizeof(uint));
+    }
+}
+
+/*
+ * Record the dirents of directory block addr of inode i in the parent index.
+ * Only used to complete the index for a diagnostic raised before the inode
+ * pass reached every directory, so bad addresses and inums are skipped here
+ * rather than reported, as are dirents of a directory naming itself. Entries
+ * the pass already set are kept, as the directory it failed in is walked
+ * again. The sort engine sets none, so the walk fills the whole index and
+ * the last link wins as in the pass of the array engine.
+ */
+static void index_block(struct xstate *st, uint addr, uint i) {
+    if (addr < st->blockstart || addr >= st->sb->size || is_hole(st, addr)) {
+        return;
+    }
+    struct dirent *dirents = (struct dirent *)((char*) st->map + (addr * BSIZE));
+    for (uint k = 0; k < DPB; ++k) {
+        if (dirents[k].inum != 0 && dirents[k].inum < st->sb->ninodes && dirents[k].inum != i
+            && strcmp(dirents[k].name, ".") != 0 && strcmp(dirents[k].name, "..") != 0
+            && (st->drefs || st->parents[dirents[k].inum].parent == 0)) {
+            st->parents[dirents[k].inum] = (struct pent){ i, addr * DPB + k };
+        }
+    }
+}
+
+/*
+ * Addresses held by indirect block ind, NULL if it cannot be read.
+ */
+static uint *index_indirect(struct xstate *st, uint ind) {
+    if (ind < st->blockstart || ind >= st->sb->size || is_hole(st, ind)) {
+        return NULL;
+    }
+    return (uint *) ((char *)st->map + ind * BSIZE);
+}
+
+/*
+ * Complete the parent index with the directories the inode pass has not
+ * walked yet. The sort engine only buffers inums, so its index is built
+ * here from every directory, and only when something needs it.
+ */
+static void index_rest(struct xstate *st) {
+    struct dinode *inode_table = (struct dinode *)((char *)st->map + st->sb->inodestart * BSIZE);
+    for (uint i = st->drefs ? 0 : st->scanned; i < st->sb->ninodes; ++i) {
+        struct dinode *inode = &inode_table[i];
+        if (inode->type != T_DIR) {
+            continue;
+        }
+        for (uint j = 0; j < bmap.ndirect; ++j) {
+            index_block(st, inode->addrs[j], i);
+        }
+        uint *indirect_addrs = index_indirect(st, inode->addrs[bmap.ndirect]);
+        for (uint j = 0; indirect_addrs && j < NINDIRECT; ++j) {
+            index_block(st, indirect_addrs[j], i);
+        }
+        uint *l1 = bmap.dindirect ? index_indirect(st, inode->addrs[bmap.dindirect]) : NULL;
+        for (uint j = 0; l1 && j < NINDIRECT; ++j) {
+            indirect_addrs = index_indirect(st, l1[j]);
+            for (uint k = 0; indirect_addrs && k < NINDIRECT; ++k) {
+                index_block(st, indirect_addrs[k], i);
+            }
+        }
+    }
+    st->scanned = st->sb->ninodes;
+}
+
+/*
+ * Path of inode inum, rebuilt from the parent index. Paths are memoised, so
+ * reporting many inodes under one directory walks its ancestors only once.
+ * Returns NULL if inum cannot be reached from the root.
+ */
+static const char *inode_path(struct xstate *st, uint inum, uint depth) {
+    if (inum == ROOTINO) {
+        return "/";
+    }
+    if (inum >= st->sb->ninodes) {
+        return NULL;
+    }
+    if (st->paths[inum]) {
+        return st->paths[inum];
+    }
+
+    // No path is longer than MAXPATH, deeper chains are directory cycles
+    struct pent *p = &st->parents[inum];
+    if (p->parent == 0 || depth >= MAXPATH) {
+        return NULL;
+    }
+    const char *prefix = inode_path(st, p->parent, depth + 1);
+    if (!prefix) {
+        return NULL;
+    }
+
+    struct dirent *de = (struct dirent *)((char *)st->map + (size_t)p->slot * sizeof(struct dirent));
+    size_t len = strlen(prefix) + DIRSIZ + 2;
+    char *path = malloc(len);
+    if (!path) {
+        return NULL;
+    }
+    snprintf(path, len, "%s%s%.*s", prefix, prefix[1] ? "/" : "", DIRSIZ, de->name);
+    st->paths[inum] = path;
+    return path;
+}
+
+/*
+ * Same as die, but also report the inode the error was found on and its
+ * path. Paths are only resolved here, so a clean check pays nothing for
+ * them but the parent index writes. While sampling, the error ends the
+ * check of the inode only.
+ */
+void die_inode(struct xstate *st, const char *msg, uint inum) {
+    fprintf(stderr, "ERROR: %s\n", msg);
+    if (st->trap) {
+        // Resolving the path needs every directory, which sampling skips
+        fprintf(stderr, "  inode %u\n", inum);
+        longjmp(*st->trap, 1);
+    }
+    if (!st->paths) {
+        st->paths = calloc(st->sb->ninodes, sizeof(char *));
+        index_rest(st);
+    }
+    const char *path = st->paths ? inode_path(st, inum, 0) : NULL;
+    fprintf(stderr, "  inode %u: %s\n", inum, path ? path : "(not in any directory)");
+    finish(1);
+}
 
 /*
  * Check #8: Consistency of inodes that are used and their references
@@ -24,23 +457,49 @@
  * Also, for every used inode, if they are a file, their nlink must be equal to
  * the ref count, and if they are a directory, their ref must be 1.
  */
-void check8(struct superblock *sb, struct dinode *inode_table, uint *inode_used, uint *inode_refd) {
-    // Check #8 used inode is also referenced 
-    for (uint i = 0; i < sb->ninodes; ++i) {
-        if (inode_used[i] && inode_refd[i] == 0) {
-            die("inode marked use but not found in a directory");
+static inline void check8_inode(struct xstate *st, struct dinode *inode_table, uint i, uint used, uint refd) {
+    if (used && refd == 0) {
+        die_inode(st, "inode marked use but not found in a directory", i);
+    }
+    if (!used && refd > 0) {
+        die_inode(st, "inode referred to in directory but marked free", i);
+    }
+    if (used) {
+        struct dinode *inode = &inode_table[i];
+        if (inode->type == T_FILE && inode->nlink != refd) {
+            die_inode(st, "bad reference count for file", i);
         }
-        if (!inode_used[i] && inode_refd[i] > 0) {
-            die("inode referred to in directory but marked free");
+        if (inode->type == T_DIR && refd != 1) {
+            die_inode(st, "directory appears more than once in file system", i);
         }
-        if (inode_used[i]) {
-            struct dinode *inode = &inode_table[i];
-            if (inode->type == T_FILE && inode->nlink != inode_refd[i]) {
-                die("bad reference count for file");
-            }
-            if (inode->type == T_DIR && inode_refd[i] != 1) {
-                die("directory appears more than once in file system");
-            }
+    }
+}
+
+void check8(struct xstate *st, struct dinode *inode_table) {
+    // Check #8 used inode is also referenced 
+    for (uint i = 0; i < st->sb->ninodes; ++i) {
+        check8_inode(st, inode_table, i, st->inode_used[i], st->inode_refd[i]);
+    }
+}
+
+/*
+ * Check #8v2: Consistency of inodes that are used and their references
+ * Same as #8 for the sort engine. The references are sorted by inum, so the
+ * count of each inode is the length of its run, and the runs are merged
+ * with the inodes in order. The counts are also stored in inode_refd for
+ * the index if it is emitted.
+ */
+void check8v2(struct xstate *st, struct dinode *inode_table, uint *keys, uint nkeys, int store) {
+    uint r = 0;
+    for (uint i = 0; i < st->sb->ninodes; ++i) {
+        uint refd = 0;
+        while (r < nkeys && keys[r] == i) {
+            refd++;
+            r++;
+        }
+        check8_inode(st, inode_table, i, st->inode_used[i], refd);
+        if (store) {
+            st->inode_refd[i] = refd;
         }
     }
 }
@@ -51,30 +510,46 @@ void check8(struct superblock *sb, struct dinode *inode_table, uint *inode_used,
  * blocks that are used as used in block_used data structure. This should be
  * equivalent to the bitmap that's written in the filesystem image. Thus, we
  * check for every bit (which corresponds to each block in fs img), if the
- * corresponding block was actually used or not.
+ * corresponding block was actually used or not. Both sets are compared a
+ * word of 64 blocks at a time.
  */
-void check7(uint8 *bitmap, uint *block_used, uint8 nbitmaps) {
-    for (uint8 i = 0; i < nbitmaps; ++i) {
-        for (uint8 j = 0; j < 8; ++j) {
-            uint8 bit = (bitmap[i] >> j) & 1;
-            if (bit && !block_used[(i * 8) + j]) {
+void check7(uint64_t *bitmap, uint64_t *block_used, uint nbitmaps) {
+    uint nbits = nbitmaps * 8;
+    for (uint w = 0; w * 64 < nbits; ++w) {
+        // Compare 64 blocks at once and only look at the first mismatch
+        uint64_t diff = bitmap[w] ^ block_used[w];
+        if (nbits - w * 64 < 64) {
+            diff &= (1ULL << (nbits - w * 64)) - 1;
+        }
+        if (diff) {
+            if (bitmap[w] & diff & -diff) {
                 die("bitmap marks block in use but it is not in use");
             }
-            if (!bit && block_used[(i * 8) + j]) {
-                die("address used by inode but marked free in bitmap");
-            }
+            die("address used by inode but marked free in bitmap");
         }
     }
 }
 
+/*
+ * Check #9: Inode size consistency
+ * xv6 never leaves holes in a file, so the number of data blocks an inode
+ * holds (the indirect block itself excluded) must be exactly the number of
+ * blocks needed to store inode->size bytes.
+ */
+void check9(struct xstate *st, struct dinode *inode, uint i, uint nblocks) {
+    if (nblocks != inode->size / BSIZE + (inode->size % BSIZE != 0)) {
+        die_inode(st, "inode size does not match allocated blocks", i);
+    }
+}
+
 /*
  * Check #6v2: Directory not properly formatted
  * For every inode that is in use and is of type T_DIR, we check if they had
  * "." and ".." dirents as they must.
  */
-void check6v2(struct dinode *inode, uint current_path_found, uint parent_path_found) {
-    if (inode->type == T_DIR && (!current_path_found || !parent_path_found)) {
-        die("directory not properly formatted1");
+void check6v2(struct xstate *st, uint i, uint current_path_found, uint parent_path_found) {
+    if (!current_path_found || !parent_path_found) {
+        die_inode(st, "directory not properly formatted1", i);
     }
 }
 
@@ -83,24 +558,38 @@ void check6v2(struct dinode *inode, uint current_path_found, uint parent_path_fo
  * Every inode that has a type T_DIR is a directory and they contain dirent
  * structures. We extract these dirent structures and check if they have
  * mandatory dirents with path "." and "..". We also make sure that the inum
- * of the dirent with "." path has the same inode as the directory itself.
+ * of the dirent with "." path has the same inode as the directory itself,
+ * and that the dirent with ".." path refers to an inode in the table.
  * Finally, we count references to the inodes that are referred to by dirents
- * with non-zero inums.
- */
-void check6 (void *map, short type, uint addr, uint i, uint *inode_refd, uint *current_path_found, uint *parent_path_found) {
-    if (type == T_DIR) {
-        struct dirent *dirents = (struct dirent *)((char*) map + (addr * BSIZE));
-        for (uint k = 0; k < BSIZE / sizeof(struct dirent); ++k) {
-            if (dirents[k].inum != 0) {
-                if (strcmp(dirents[k].name, ".") == 0) {
-                    *current_path_found = 1;
-                    if (dirents[k].inum != i) {
-                        die("directory not properly formatted");
-                    }
-                } else if (strcmp(dirents[k].name, "..") == 0) {
-                    *parent_path_found = 1;
+ * with non-zero inums, and record where they were found in the parent index.
+ */
+static inline void check6(struct xstate *st, uint addr, uint i, uint *current_path_found, uint *parent_path_found) {
+    struct dirent *dirents = (struct dirent *)((char*) st->map + (addr * BSIZE));
+    for (uint k = 0; k < DPB; ++k) {
+        if (dirents[k].inum != 0) {
+            if (strcmp(dirents[k].name, ".") == 0) {
+                *current_path_found = 1;
+                if (dirents[k].inum != i) {
+                    die_inode(st, "directory not properly formatted", i);
+                }
+            } else if (strcmp(dirents[k].name, "..") == 0) {
+                *parent_path_found = 1;
+                if (dirents[k].inum >= st->sb->ninodes) {
+                    die_inode(st, "directory not properly formatted", i);
+                }
+            } else {
+                // An inum past the inode table cannot be a used inode
+                if (dirents[k].inum >= st->sb->ninodes) {
+                    die_inode(st, "inode referred to in directory but marked free", i);
+                }
+                if (st->drefs) {
+                    add_dref(st, dirents[k].inum);
                 } else {
-                    inode_refd[dirents[k].inum]++;
+                    st->inode_refd[dirents[k].inum]++;
+                    st->parents[dirents[k].inum] = (struct pent){ i, addr * DPB + k };
+                }
+                if (st->log) {
+                    push_ref(st->log, (struct dref){ dirents[k].inum, { i, addr * DPB + k } });
                 }
             }
         }
@@ -108,71 +597,268 @@ void check6 (void *map, short type, uint addr, uint i, uint *inode_refd, uint *c
 }
 
 /*
- * Check #5v2: Indirect address used more than once
- * Same as #5 but for indirect addresses.
+ * Check #4v2 and #5v2: Bad indirect address / indirect address used more
+ * than once
+ * Same as #4 and #5 but for the addresses stored in the indirect block.
  */
-void check5v2(uint addr, uint *block_used) {
-    if (addr != 0) {
-        if (block_used[addr]) {
-            die("indirect address used more than once");
-        }
-        block_used[addr] = 1;
+static inline void check45v2(struct xstate *st, uint addr, uint i) {
+    if (addr > st->sb->size || addr < st->blockstart) {
+        die_inode(st, "bad indirect address in inode", i);
+    }
+    if (test_block(st->block_used, addr)) {
+        die_inode(st, "indirect address used more than once", i);
+    }
+    set_block(st->block_used, addr);
+    if (st->log) {
+        push_blk(st->log, addr);
+    }
+}
+
+/*
+ * Check #4 and #5: Bad direct address / direct address used more than once
+ * For every inode that is in use, if their direct addresses are in use,
+ * which is indicated with the addr field being non-zero, then make sure,
+ * this addr is within the boundaries of the filesystem image and it has
+ * a valid value. As we keep track of used addresses in block_used, we also
+ * make sure that they are not being used more than once as this would make
+ * the filesystem inconsistent. The callers skip zero addresses.
+ */
+static inline void check45(struct xstate *st, uint addr, uint i) {
+    if (addr > st->sb->size || addr < st->blockstart) {
+        die_inode(st, "bad direct address in inode", i);
+    }
+    if (test_block(st->block_used, addr)) {
+        die_inode(st, "direct address used more than once", i);
     }
+    set_block(st->block_used, addr);
+    if (st->log) {
+        push_blk(st->log, addr | CLAIM_DIRECT);
+    }
+}
+
+/*
+ * Claim the indirect block of an inode, if it has one, and return a pointer
+ * to the indirect addresses it holds. An indirect block in a hole holds no
+ * addresses, so NULL is returned for it as well.
+ */
+static inline uint *indirect_block(struct xstate *st, struct dinode *inode, uint i) {
+    uint ind = inode->addrs[bmap.ndirect];
+    if (ind == 0) {
+        return NULL;
+    }
+    check45(st, ind, i);
+    if (is_hole(st, ind)) {
+        return NULL;
+    }
+    return (uint *) ((char *)st->map + ind * BSIZE);
 }
 
 /*
- * Check #5: Direct address used more than once
- * We keep track of direct addresses to see if they are really used.
- * As we keep track of them, we also need to make sure that they are not
- * being used more than once as this would make the filesystem inconsistent.
- * So we check if any non-zero address is used before and set it to used.
+ * Walker of the double-indirect tree of an inode
+ * A multi-MB file spreads its addresses over up to NINDIRECT indirect
+ * blocks, and following them in file order jumps back and forth across the
+ * image. The tree is walked breadth first instead: the indirect blocks are
+ * claimed and read in block order, and for a directory its data blocks are
+ * scanned in block order as well, so the image is read sequentially.
+ * Returns the number of data blocks, and counts the runs of the data blocks
+ * on from prev in file order. Directories pass their "." and ".." flags.
  */
-void check5(uint addr, uint *block_used) {
-    if (addr != 0) {
-        if (block_used[addr]) {
-            die("direct address used more than once");
+static uint walk_dindirect(struct xstate *st, struct dinode *inode, uint i,
+                           uint *current_path_found, uint *parent_path_found, uint *runs, uint *prev) {
+    static uint data[NINDIRECT * NINDIRECT], tmp[NINDIRECT * NINDIRECT];
+    uint root = bmap.dindirect ? inode->addrs[bmap.dindirect] : 0;
+    if (root == 0) {
+        return 0;
+    }
+    check45(st, root, i);
+    if (is_hole(st, root)) {
+        return 0;
+    }
+    uint *l1 = (uint *) ((char *)st->map + root * BSIZE);
+
+    // The indirect blocks, in block order
+    uint order[NINDIRECT], n1 = 0;
+    for (uint j = 0; j < NINDIRECT; ++j) {
+        if (l1[j] != 0) {
+            order[n1++] = l1[j];
+        }
+    }
+    radix_sort(order, tmp, n1, UINT_MAX);
+    for (uint k = 0; k < n1; ++k) {
+        check45v2(st, order[k], i);
+    }
+
+    // Their data blocks, directory blocks are only collected here
+    uint nblocks = 0, ndata = 0;
+    for (uint k = 0; k < n1; ++k) {
+        if (is_hole(st, order[k])) {
+            continue;
+        }
+        uint *indirect_addrs = (uint *) ((char *)st->map + order[k] * BSIZE);
+        for (uint j = 0; j < NINDIRECT; ++j) {
+            if (indirect_addrs[j] != 0) {
+                check45v2(st, indirect_addrs[j], i);
+                nblocks++;
+                if (current_path_found && !is_hole(st, indirect_addrs[j])) {
+                    data[ndata++] = indirect_addrs[j];
+                }
+            }
+        }
+    }
+    if (current_path_found) {
+        radix_sort(data, tmp, ndata, UINT_MAX);
+        for (uint k = 0; k < ndata; ++k) {
+            check6(st, data[k], i, current_path_found, parent_path_found);
+        }
+    }
+
+    // Runs follow the file order
+    for (uint j = 0; st->runs && j < NINDIRECT; ++j) {
+        if (l1[j] == 0 || is_hole(st, l1[j])) {
+            continue;
+        }
+        uint *indirect_addrs = (uint *) ((char *)st->map + l1[j] * BSIZE);
+        for (uint k = 0; k < NINDIRECT; ++k) {
+            if (indirect_addrs[k] != 0) {
+                *runs += indirect_addrs[k] != *prev + 1;
+                *prev = indirect_addrs[k];
+            }
         }
-        block_used[addr] = 1;
     }
+    return nblocks;
 }
 
 /*
- * Check #4v3: Bad indirect address in inode
- * When an inode->addrs[NDIRECT] is valid, it means we have indirect addresses,
- * then we access the pointer that points to the indirect addresses of an inode
- * we need to make sure that this pointer is also valid.
+ * Address walker for T_FILE inodes
+ * Checks and claims every direct, indirect and double-indirect address once
+ * and returns the number of data blocks the inode holds. Runs of contiguous
+ * data blocks are counted on the way for the fragmentation report.
  */
-void check4v3(uint *indirect_addrs) {
-    if (!indirect_addrs) {
-        die("bad indirect address in inode");
+uint walk_file(struct xstate *st, struct dinode *inode, uint i) {
+    uint nblocks = 0;
+    uint runs = 0, prev = 0;
+    for (uint j = 0; j < bmap.ndirect; ++j) {
+        if (inode->addrs[j] != 0) {
+            check45(st, inode->addrs[j], i);
+            runs += inode->addrs[j] != prev + 1;
+            prev = inode->addrs[j];
+            nblocks++;
+        }
+    }
+
+    uint *indirect_addrs = indirect_block(st, inode, i);
+    if (indirect_addrs) {
+        for (uint j = 0; j < NINDIRECT; ++j) {
+            if (indirect_addrs[j] != 0) {
+                check45v2(st, indirect_addrs[j], i);
+                runs += indirect_addrs[j] != prev + 1;
+                prev = indirect_addrs[j];
+                nblocks++;
+            }
+        }
+    }
+
+    nblocks += walk_dindirect(st, inode, i, NULL, NULL, &runs, &prev);
+
+    if (st->runs) {
+        st->runs[i] = runs;
     }
+    return nblocks;
 }
 
 /*
- * Check #4v2: Bad indirect address in inode
- * The same as #4 but this time check for indirect addresses.
+ * Address walker for T_DIR inodes
+ * Same as walk_file, but also scans the dirents of every data block while
+ * it is being claimed.
  */
-void check4v2(struct superblock *sb, uint addr, uint blockstart) {
-    if (addr != 0) {
-        if (addr > sb->size || addr < blockstart) {
-            die("bad indirect address in inode");
+uint walk_dir(struct xstate *st, struct dinode *inode, uint i) {
+    uint nblocks = 0;
+    uint runs = 0, prev = 0;
+
+    // Flags to mark "." and ".." dirents found
+    uint current_path_found = 0;
+    uint parent_path_found = 0;
+
+    for (uint j = 0; j < bmap.ndirect; ++j) {
+        if (inode->addrs[j] != 0) {
+            check45(st, inode->addrs[j], i);
+            if (!is_hole(st, inode->addrs[j])) {
+                check6(st, inode->addrs[j], i, &current_path_found, &parent_path_found);
+            }
+            runs += inode->addrs[j] != prev + 1;
+            prev = inode->addrs[j];
+            nblocks++;
+        }
+    }
+
+    uint *indirect_addrs = indirect_block(st, inode, i);
+    if (indirect_addrs) {
+        for (uint j = 0; j < NINDIRECT; ++j) {
+            if (indirect_addrs[j] != 0) {
+                check45v2(st, indirect_addrs[j], i);
+                if (!is_hole(st, indirect_addrs[j])) {
+                    check6(st, indirect_addrs[j], i, &current_path_found, &parent_path_found);
+                }
+                runs += indirect_addrs[j] != prev + 1;
+                prev = indirect_addrs[j];
+                nblocks++;
+            }
         }
     }
+
+    nblocks += walk_dindirect(st, inode, i, &current_path_found, &parent_path_found, &runs, &prev);
+
+    check6v2(st, i, current_path_found, parent_path_found);
+    if (st->runs) {
+        st->runs[i] = runs;
+    }
+    return nblocks;
 }
 
 /*
- * Check #4: Bad direct address in inode
- * For every inode that is in use, if their direct addresses are in use,
- * which is indicated with the addr field being non-zero, then make sure,
- * this addr is within the boundaries of the filesystem image and it has
- * a valid value.
+ * Address walker for T_DEVICE inodes
+ * Devices keep no data in xv6, but any addresses they do hold must still be
+ * valid and owned by them alone.
+ */
+uint walk_device(struct xstate *st, struct dinode *inode, uint i) {
+    return walk_file(st, inode, i);
+}
+
+/*
+ * Find the first inode at or after i that may be in use
+ * An inode with a zero type is free and passes check #3, so there is
+ * nothing to check on it. The first word of every dinode holds its type
+ * (with major, minor and nlink), and the first words of a whole inode table
+ * block are or-reduced without branches, so a block of free inodes costs a
+ * handful of instructions and is skipped at once. Inode table blocks in a
+ * hole of the image are skipped without being read at all. Every inode with
+ * a non-zero type, valid or not, is returned and goes through check #3.
  */
-void check4(struct superblock *sb, uint addr, uint blockstart) {
-    if (addr != 0) {
-        if (addr > sb->size || addr < blockstart) {
-            die("bad direct address in inode");
+static uint next_inode(struct xstate *st, struct dinode *inode_table, uint i) {
+    const uint64_t *words = (const uint64_t *)inode_table;
+    const uint wpi = sizeof(struct dinode) / sizeof(uint64_t);
+    uint ninodes = st->sb->ninodes;
+    while (i < ninodes) {
+        if (i % IPB == 0 && i + IPB <= ninodes) {
+            if (is_hole(st, st->sb->inodestart + i / IPB)) {
+                i += IPB;
+                continue;
+            }
+            uint64_t acc = 0;
+            for (uint k = 0; k < IPB; ++k) {
+                acc |= words[(i + k) * wpi];
+            }
+            if (acc == 0) {
+                i += IPB;
+                continue;
+            }
+        }
+        if (inode_table[i].type != 0) {
+            return i;
         }
+        i++;
     }
+    return ninodes;
 }
 
 /*
@@ -180,9 +866,9 @@ void check4(struct superblock *sb, uint addr, uint blockstart) {
  * Make sure that any inode is either not used, type 0, or if it's used,
  * the type is set to one of three valid values.
  */
-void check3(struct dinode *inode) {
+void check3(struct xstate *st, struct dinode *inode, uint i) {
     if (inode->type != 0 && inode->type != T_FILE && inode->type != T_DIR && inode->type != T_DEVICE) {
-        die("bad inode");
+        die_inode(st, "bad inode", i);
     }
 }
 
@@ -221,32 +907,555 @@ void check1(struct superblock *sb, uint inodes_block_size, uint bitmaps_block_si
     }
 }
 
-void sb_log(struct superblock *sb, uint inodes_block_size, uint bitmaps_block_size, uint blockstart, uint8 nbitmaps) {
-    // logs
-    printf("sb->magic: 0x%x\n", sb->magic);
-    printf("sb->size: 0x%x\n", sb->size);
-    printf("sb->nblocks: 0x%x\n", sb->nblocks);
-    printf("sb->ninodes: 0x%x\n", sb->ninodes);
-    printf("sb->nlog: 0x%x\n", sb->nlog);
-    printf("sb->logstart: 0x%x\n", sb->logstart);
-    printf("sb->inodestart: 0x%x\n", sb->inodestart);
-    printf("sb->bmapstart: 0x%x\n", sb->bmapstart);
-    printf("nbitmaps: 0x%x\n", nbitmaps);
-    printf("bitmaps_block_size: 0x%x\n", bitmaps_block_size);
-    printf("blockstart: 0x%x\n", blockstart);
-    printf("inodes_block_size: 0x%x\n", inodes_block_size);
-    printf("Expected data blocks start at: %d\n", sb->bmapstart + bitmaps_block_size);
-    printf("Computed blockstart: %d\n", blockstart);
+/*
+ * Collect the data blocks of a validated inode in file order, returning
+ * their number.
+ */
+static uint indirect_blocks(struct xstate *st, uint ind, uint32_t *blocks) {
+    uint n = 0;
+    if (ind != 0 && !is_hole(st, ind)) {
+        uint *indirect_addrs = (uint *) ((char *)st->map + ind * BSIZE);
+        for (uint j = 0; j < NINDIRECT; ++j) {
+            if (indirect_addrs[j] != 0) {
+                blocks[n++] = indirect_addrs[j];
+            }
+        }
+    }
+    return n;
 }
 
-void xcheck(void *map) {
-    // Get the superblock
-    struct superblock *sb = (struct superblock *) ((char *)map + BSIZE);
-
-    // Get the number of bitmaps each of which is a byte
-    uint8 nbitmaps = sb->nblocks / 8 + (sb->nblocks % 8 != 0);
-
-    // Get the size of total bitmaps in blocks
+static uint data_blocks(struct xstate *st, struct dinode *inode, uint32_t *blocks) {
+    uint n = 0;
+    for (uint j = 0; j < bmap.ndirect; ++j) {
+        if (inode->addrs[j] != 0) {
+            blocks[n++] = inode->addrs[j];
+        }
+    }
+    n += indirect_blocks(st, inode->addrs[bmap.ndirect], blocks + n);
+    uint root = bmap.dindirect ? inode->addrs[bmap.dindirect] : 0;
+    if (root != 0 && !is_hole(st, root)) {
+        uint *l1 = (uint *) ((char *)st->map + root * BSIZE);
+        for (uint j = 0; j < NINDIRECT; ++j) {
+            n += indirect_blocks(st, l1[j], blocks + n);
+        }
+    }
+    return n;
+}
+
+static int by_size(const void *a, const void *b, void *arg) {
+    struct xidx_inode *inodes = arg;
+    uint32_t sa = inodes[*(const uint32_t *)a].size;
+    uint32_t sb = inodes[*(const uint32_t *)b].size;
+    return (sa > sb) - (sa < sb);
+}
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+/*
+ * Write the metadata index of a checked image
+ * Only called once every check passed, so the inode table, block lists and
+ * directories are known to be valid and are walked without checks. Only
+ * "." and ".." are not in the parent index, so they name no inode. The
+ * index is written to a temporary file and renamed over path, so readers
+ * never see a partial index.
+ */
+void emit_index(struct xstate *st, struct dinode *inode_table, const char *path) {
+    struct superblock *sb = st->sb;
+    static uint32_t blocks[XMAXFILE];
+
+    // Size the sections, name offset 0 is the empty name of the root
+    struct xidx_header h = { XIDX_MAGIC, XIDX_VERSION, sb->size };
+    h.namesz = 1;
+    for (uint i = 0; i < sb->ninodes; ++i) {
+        struct dinode *inode = &inode_table[i];
+        if (inode->type == 0) {
+            continue;
+        }
+        h.ninodes++;
+        uint n = data_blocks(st, inode, blocks);
+        h.nblocks += n;
+        for (uint j = 0; inode->type == T_DIR && j < n; ++j) {
+            struct dirent *dirents = (struct dirent *)((char*) st->map + (blocks[j] * BSIZE));
+            for (uint k = 0; !is_hole(st, blocks[j]) && k < DPB; ++k) {
+                if (dirents[k].inum != 0) {
+                    h.ndirents++;
+                    h.namesz += strnlen(dirents[k].name, DIRSIZ) + 1;
+                }
+            }
+        }
+    }
+
+    // Lay out the sections
+    uint64_t off = ALIGN8(sizeof(h));
+    h.inodes = off;
+    off = ALIGN8(off + (uint64_t)h.ninodes * sizeof(struct xidx_inode));
+    h.blocks = off;
+    off = ALIGN8(off + (uint64_t)h.nblocks * sizeof(uint32_t));
+    h.owner = off;
+    off = ALIGN8(off + (uint64_t)h.fssize * sizeof(uint32_t));
+    h.bysize = off;
+    off = ALIGN8(off + (uint64_t)h.ninodes * sizeof(uint32_t));
+    h.dirents = off;
+    off = ALIGN8(off + (uint64_t)h.ndirents * sizeof(struct xidx_dirent));
+    h.names = off;
+    off = ALIGN8(off + h.namesz);
+
+    char *buf = calloc(1, off);
+    uint32_t *name_of = malloc(sb->ninodes * sizeof(uint32_t));
+    if (!buf || !name_of) {
+        printf("index allocation failed\n");
+        exit(1);
+    }
+    memcpy(buf, &h, sizeof(h));
+    struct xidx_inode *inodes = (struct xidx_inode *)(buf + h.inodes);
+    uint32_t *blk = (uint32_t *)(buf + h.blocks);
+    uint32_t *owner = (uint32_t *)(buf + h.owner);
+    uint32_t *bysize = (uint32_t *)(buf + h.bysize);
+    struct xidx_dirent *dirents = (struct xidx_dirent *)(buf + h.dirents);
+    char *names = buf + h.names;
+
+    // Fill the inode summaries, block lists and dirents in inum order
+    uint32_t ni = 0, nb = 0, nd = 0, nn = 1;
+    for (uint i = 0; i < sb->ninodes; ++i) {
+        struct dinode *inode = &inode_table[i];
+        if (inode->type == 0) {
+            continue;
+        }
+        struct xidx_inode *x = &inodes[ni++];
+        x->inum = i;
+        x->type = inode->type;
+        x->nlink = inode->nlink;
+        x->size = inode->size;
+        x->refs = st->inode_refd[i];
+        x->indirect = inode->addrs[bmap.ndirect];
+        x->dindirect = bmap.dindirect ? inode->addrs[bmap.dindirect] : 0;
+        x->blk = nb;
+        x->dir = nd;
+        x->parent = i;
+        if (x->indirect) {
+            owner[x->indirect] = i;
+        }
+        uint root = x->dindirect;
+        if (root) {
+            owner[root] = i;
+            uint *l1 = (uint *) ((char *)st->map + root * BSIZE);
+            for (uint j = 0; !is_hole(st, root) && j < NINDIRECT; ++j) {
+                if (l1[j]) {
+                    owner[l1[j]] = i;
+                }
+            }
+        }
+
+        uint n = data_blocks(st, inode, blk + nb);
+        for (uint j = nb; j < nb + n; ++j) {
+            owner[blk[j]] = i;
+            if (inode->type != T_DIR || is_hole(st, blk[j])) {
+                continue;
+            }
+            struct dirent *de = (struct dirent *)((char*) st->map + (blk[j] * BSIZE));
+            for (uint k = 0; k < DPB; ++k) {
+                if (de[k].inum != 0) {
+                    size_t len = strnlen(de[k].name, DIRSIZ);
+                    if (de[k].inum < sb->ninodes && strcmp(de[k].name, ".") != 0 && strcmp(de[k].name, "..") != 0
+                        && st->parents[de[k].inum].slot == blk[j] * DPB + k) {
+                        name_of[de[k].inum] = nn;
+                    }
+                    dirents[nd++] = (struct xidx_dirent){ de[k].inum, nn };
+                    memcpy(names + nn, de[k].name, len);
+                    nn += len + 1;
+                }
+            }
+        }
+        nb += n;
+    }
+
+    // Name every inode after the dirent the parent index points at
+    for (uint k = 0; k < h.ninodes; ++k) {
+        uint i = inodes[k].inum;
+        if (i != ROOTINO && st->parents[i].parent != 0) {
+            inodes[k].parent = st->parents[i].parent;
+            inodes[k].name = name_of[i];
+        }
+    }
+
+    for (uint32_t k = 0; k < h.ninodes; ++k) {
+        bysize[k] = k;
+    }
+    qsort_r(bysize, h.ninodes, sizeof(uint32_t), by_size, inodes);
+
+    // Write the index next to its destination and move it in place
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        printf("index open failed with errno %d\n", errno);
+        exit(1);
+    }
+    for (uint64_t done = 0; done < off; ) {
+        ssize_t w = write(fd, buf + done, off - done);
+        if (w < 0) {
+            printf("index write failed with errno %d\n", errno);
+            unlink(tmp);
+            exit(1);
+        }
+        done += w;
+    }
+    close(fd);
+    if (rename(tmp, path) != 0) {
+        printf("index rename failed with errno %d\n", errno);
+        unlink(tmp);
+        exit(1);
+    }
+
+    free(name_of);
+    free(buf);
+}
+
+/*
+ * Space report
+ * Free and used counts are popcounts over the on-disk bitmap and the block
+ * set computed by the inode pass, and free extents are found by skipping
+ * whole words with count-trailing-zeros, so the report costs a few word
+ * scans of the bitmap on top of the check. Fragmentation is the number of
+ * contiguous runs of data blocks each inode walker counted.
+ */
+void space_report(struct xstate *st, struct dinode *inode_table, uint64_t *bitmap) {
+    struct superblock *sb = st->sb;
+    uint from = st->blockstart, to = sb->size;
+
+    uint used = count_blocks(bitmap, from, to);
+    printf("space: %u data blocks, %u used, %u free\n", to - from, used, to - from - used);
+    printf("space: %u blocks used by inodes\n", count_blocks(st->block_used, from, to));
+
+    // Free extents by length, in power of two buckets
+    uint hist[32] = {0};
+    uint largest = 0, nextents = 0;
+    for (uint b = next_block(bitmap, from, to, 0); b < to; ) {
+        uint e = next_block(bitmap, b, to, 1);
+        uint len = e - b;
+        hist[31 - __builtin_clz(len)]++;
+        largest = len > largest ? len : largest;
+        nextents++;
+        b = next_block(bitmap, e, to, 0);
+    }
+    printf("free extents: %u, largest %u blocks\n", nextents, largest);
+    for (uint k = 0; k < 32; ++k) {
+        if (hist[k]) {
+            printf("  %u-%u blocks: %u\n", 1U << k, (2U << k) - 1, hist[k]);
+        }
+    }
+
+    // Inodes whose data is split in more than one run
+    uint files = 0, fragmented = 0;
+    for (uint i = 0; i < sb->ninodes; ++i) {
+        if (inode_table[i].type == 0 || inode_table[i].type == T_DEVICE) {
+            continue;
+        }
+        files++;
+        fragmented += st->runs[i] > 1;
+    }
+    printf("fragmentation: %u of %u inodes in more than one run\n", fragmented, files);
+    if (fragmented && !st->paths) {
+        st->paths = calloc(sb->ninodes, sizeof(char *));
+    }
+    for (uint i = 0; i < sb->ninodes; ++i) {
+        if (inode_table[i].type != 0 && inode_table[i].type != T_DEVICE && st->runs[i] > 1) {
+            const char *path = st->paths ? inode_path(st, i, 0) : NULL;
+            printf("  inode %u: %u runs %s\n", i, st->runs[i], path ? path : "");
+        }
+    }
+}
+
+void sb_log(struct superblock *sb, uint inodes_block_size, uint bitmaps_block_size, uint blockstart, uint nbitmaps) {
+    // logs
+    printf("sb->magic: 0x%x\n", sb->magic);
+    printf("sb->size: 0x%x\n", sb->size);
+    printf("sb->nblocks: 0x%x\n", sb->nblocks);
+    printf("sb->ninodes: 0x%x\n", sb->ninodes);
+    printf("sb->nlog: 0x%x\n", sb->nlog);
+    printf("sb->logstart: 0x%x\n", sb->logstart);
+    printf("sb->inodestart: 0x%x\n", sb->inodestart);
+    printf("sb->bmapstart: 0x%x\n", sb->bmapstart);
+    printf("nbitmaps: 0x%x\n", nbitmaps);
+    printf("bitmaps_block_size: 0x%x\n", bitmaps_block_size);
+    printf("blockstart: 0x%x\n", blockstart);
+    printf("inodes_block_size: 0x%x\n", inodes_block_size);
+    printf("Expected data blocks start at: %d\n", sb->bmapstart + bitmaps_block_size);
+    printf("Computed blockstart: %d\n", blockstart);
+}
+
+/*
+ * Create an arena of at least size bytes. With huge set, try to back it
+ * with explicit huge pages first and fall back to transparent huge pages.
+ */
+void arena_init(struct arena *a, size_t size, int huge) {
+    a->used = 0;
+    a->base = MAP_FAILED;
+    if (huge) {
+        a->size = (size + HUGESZ - 1) & ~(HUGESZ - 1);
+        a->base = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (a->base == MAP_FAILED) {
+        a->size = size;
+        a->base = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (a->base == MAP_FAILED) {
+            printf("arena mmap failed with errno %d\n", errno);
+            exit(1);
+        }
+        if (huge) {
+            madvise(a->base, a->size, MADV_HUGEPAGE);
+        }
+    }
+}
+
+/*
+ * Get n zeroed bytes from the arena, aligned to a cache line.
+ */
+void *arena_alloc(struct arena *a, size_t n) {
+    size_t off = (a->used + 63) & ~(size_t)63;
+    if (off + n > a->size) {
+        printf("arena exhausted\n");
+        exit(1);
+    }
+    a->used = off + n;
+    return a->base + off;
+}
+
+void arena_free(struct arena *a) {
+    munmap(a->base, a->size);
+}
+
+/*
+ * Make a kept arena ready for the next check of at least size bytes. Only
+ * the part the last check used is zeroed, the rest is still untouched, and
+ * the pages stay mapped, so a warm arena takes no page faults.
+ */
+void arena_reset(struct arena *a, size_t size, int huge) {
+    memset(a->base, 0, a->used);
+    a->used = 0;
+    if (a->size < size) {
+        arena_free(a);
+        arena_init(a, size, huge);
+    }
+}
+
+/*
+ * Advise the kernel about the regions of the image that are scanned front
+ * to back: the inode table and the bitmap. madvise needs page aligned
+ * ranges, so the regions are widened to page boundaries.
+ */
+void advise_regions(void *map, uint start, uint nblocks) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t from = ((uintptr_t)map + (uintptr_t)start * BSIZE) & ~(page - 1);
+    uintptr_t to = (uintptr_t)map + (uintptr_t)(start + nblocks) * BSIZE;
+    madvise((void *)from, to - from, MADV_SEQUENTIAL);
+    madvise((void *)from, to - from, MADV_HUGEPAGE);
+}
+
+/*
+ * Run the per-inode checks (#3, #4, #5, #6, #9) on inode i and return the
+ * number of data blocks it holds.
+ */
+static uint check_inode(struct xstate *st, struct dinode *inode, uint i, int level) {
+    check3(st, inode, i);
+
+    // In use inodes
+    uint nblocks = 0;
+    if (inode->type != 0) {
+        st->scanned = i;
+
+        // Mark as used inode
+        st->inode_used[i] = 1;
+
+        // Walk the addresses with the walker of the inode type
+        switch (inode->type) {
+        case T_FILE:
+            nblocks = walk_file(st, inode, i);
+            break;
+        case T_DIR:
+            if (level >= LEVEL_DIRS) {
+                nblocks = walk_dir(st, inode, i);
+            } else {
+                nblocks = walk_file(st, inode, i);
+            }
+            break;
+        case T_DEVICE:
+            nblocks = walk_device(st, inode, i);
+            break;
+        }
+
+        check9(st, inode, i, nblocks);
+    }
+    return nblocks;
+}
+
+/*
+ * Check a sampled inode i with the per-inode checks, and with the parts of
+ * #7 and #8 that only need the inode itself: its blocks must be marked in
+ * use in the bitmap, and its dirents must not refer to free inodes.
+ * Returns 1 if the inode failed a check, and the blocks it claims,
+ * indirect block included, in claimed otherwise.
+ */
+static int sample_inode(struct xstate *st, struct dinode *inode_table, uint i, int level,
+                        uint64_t *bitmap, uint *claimed) {
+    jmp_buf trap;
+    if (setjmp(trap)) {
+        st->trap = NULL;
+        st->log = NULL;
+        return 1;
+    }
+    st->trap = &trap;
+
+    // Keep the addresses the walkers claim
+    static struct xgroup claims;
+    claims.nblks = 0;
+    claims.nrefs = 0;
+    st->log = &claims;
+
+    struct dinode *inode = &inode_table[i];
+    check_inode(st, inode, i, level);
+    st->log = NULL;
+    if (level >= LEVEL_FULL) {
+        static uint32_t blocks[XMAXFILE];
+        uint n = data_blocks(st, inode, blocks);
+        for (uint j = 0; j < claims.nblks; ++j) {
+            if (!test_block(bitmap, claims.blks[j] & ~CLAIM_DIRECT)) {
+                die_inode(st, "address used by inode but marked free in bitmap", i);
+            }
+        }
+        for (uint j = 0; inode->type == T_DIR && j < n; ++j) {
+            struct dirent *dirents = (struct dirent *)((char*) st->map + (blocks[j] * BSIZE));
+            for (uint k = 0; !is_hole(st, blocks[j]) && k < DPB; ++k) {
+                if (dirents[k].inum == 0 || strcmp(dirents[k].name, ".") == 0
+                    || strcmp(dirents[k].name, "..") == 0) {
+                    continue;
+                }
+                if (dirents[k].inum >= st->sb->ninodes || inode_table[dirents[k].inum].type == 0) {
+                    die_inode(st, "inode referred to in directory but marked free", i);
+                }
+            }
+        }
+    }
+
+    st->trap = NULL;
+    *claimed = claims.nblks;
+    return 0;
+}
+
+/*
+ * Whether inode i is in the sample, from a hash of the seed and the inum,
+ * so that a seed always picks the same inodes of an image.
+ */
+static inline int sampled(unsigned long seed, uint i, uint64_t threshold) {
+    uint64_t x = seed * 0x9e3779b97f4a7c15ULL + i;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (x ^ (x >> 31)) <= threshold;
+}
+
+/*
+ * Sampling mode
+ * Runs the per-inode checks on a seeded random sample of the inodes in use
+ * instead of all of them, so the cost of walking their blocks and
+ * directories shrinks with the sample. Failed inodes are reported and
+ * counted rather than ending the check, and the share of corrupt inodes is
+ * estimated with a 95% Wilson score interval, which bounds the corrupt
+ * inodes among the ones left unchecked. Checks that need every inode
+ * cannot be sampled and are reported as skipped. The blocks the bitmap
+ * marks in use are compared against an estimate of the blocks all inodes
+ * own, scaled up from the sample.
+ */
+void sample_check(struct xstate *st, struct dinode *inode_table, uint64_t *bitmap, struct xopts *opts) {
+    struct superblock *sb = st->sb;
+    uint64_t threshold = opts->sample >= 100 ? UINT64_MAX : (uint64_t)(opts->sample / 100 * 0x1p64);
+    uint nused = 0, n = 0, bad = 0;
+    double sum = 0, sumsq = 0;
+    for (uint i = next_inode(st, inode_table, 0); i < sb->ninodes; i = next_inode(st, inode_table, i + 1)) {
+        nused++;
+        if (!sampled(opts->seed, i, threshold)) {
+            continue;
+        }
+        n++;
+        uint claimed;
+        if (sample_inode(st, inode_table, i, opts->level, bitmap, &claimed)) {
+            bad++;
+            continue;
+        }
+        sum += claimed;
+        sumsq += (double)claimed * claimed;
+    }
+
+    printf("sample: %u of %u inodes in use checked, seed %lu\n", n, nused, opts->seed);
+    if (n > 0) {
+        const double z = 1.96;
+        double rate = (double)bad / n;
+        double center = (rate + z * z / (2 * n)) / (1 + z * z / n);
+        double half = z * sqrt(rate * (1 - rate) / n + z * z / (4.0 * n * n)) / (1 + z * z / n);
+        double lo = center - half > 0 ? center - half : 0, hi = center + half < 1 ? center + half : 1;
+        printf("sample: %u failed, corruption rate %.3f%% (95%% confidence %.3f%% to %.3f%%)\n",
+               bad, 100 * rate, 100 * lo, 100 * hi);
+        // The failed inodes are known, only the unchecked ones are estimated
+        uint rest = nused - n;
+        printf("sample: about %.0f corrupt inodes (95%% confidence %.0f to %.0f)\n",
+               bad + rate * rest, bad + lo * rest, bad + hi * rest);
+    }
+
+    // Scale the blocks the clean sampled inodes claim up to all inodes
+    uint good = n - bad;
+    if (opts->level >= LEVEL_FULL && good > 1) {
+        double mean = sum / good;
+        double var = (sumsq - good * mean * mean) / (good - 1);
+        double owned = mean * (nused - bad * (double)nused / n);
+        double se = (nused - bad * (double)nused / n) * sqrt(var / good * (1 - (double)n / nused));
+        printf("sample: bitmap marks %u data blocks in use, inodes own about %.0f (95%% confidence %.0f to %.0f)\n",
+               count_blocks(bitmap, st->blockstart, sb->size), owned,
+               owned - 1.96 * se > 0 ? owned - 1.96 * se : 0, owned + 1.96 * se);
+    }
+
+    printf("skipped: #5 addresses shared with inodes outside the sample\n");
+    if (opts->level >= LEVEL_FULL) {
+        printf("skipped: #7 blocks marked in use that no inode owns\n");
+        printf("skipped: #8 reference counts and inodes in use that no directory refers to\n");
+    }
+
+    if (bad) {
+        finish(1);
+    }
+}
+
+// Chain mode inode pass, defined with the chain mode below
+void chain_pass(struct xstate *st, struct ximage *img, struct dinode *inode_table, struct xopts *opts);
+
+/*
+ * Choose the reference counting engine for REFS_AUTO
+ * The array engine increments counts at random, which is cheap while the
+ * counts stay in the private cache of the core. Dirents hold 16 bit inums,
+ * so only that many counts can be hit however large ninodes is.
+ */
+int refs_engine(struct superblock *sb, struct xopts *opts) {
+    if (opts->refs != REFS_AUTO) {
+        return opts->refs;
+    }
+    uint64_t counts = sb->ninodes < 65536 ? sb->ninodes : 65536;
+    long cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (cache_size <= 0) {
+        cache_size = 256 * 1024;
+    }
+    return counts * sizeof(uint) > (uint64_t)cache_size ? REFS_SORT : REFS_ARRAY;
+}
+
+void xcheck(struct ximage *img, struct xopts *opts) {
+    void *map = img->map;
+
+    // Get the superblock
+    struct superblock *sb = (struct superblock *) ((char *)map + BSIZE);
+
+    // Get the number of bitmaps each of which is a byte
+    uint nbitmaps = sb->nblocks / 8 + (sb->nblocks % 8 != 0);
+
+    // Get the size of total bitmaps in blocks
     uint bitmaps_block_size = ((nbitmaps * sizeof(uint8)) / BSIZE) + ((nbitmaps * sizeof(uint8)) % BSIZE != 0);
 
     // Get the size of total inodes in blocks
@@ -259,113 +1468,164 @@ void xcheck(void *map) {
     // Get the inode_table which is a table of sb->ninodes many dinode
     struct dinode *inode_table = (struct dinode *)((char *)map + sb->inodestart * BSIZE);
 
-    // Get the bitmap table which is a table of 4 byte bitmaps
-    // The total number of bitmaps is 4*8=32 bit for each, nblocks many bits
-    // nblocks divided by 32 gives us how many iters we need
+    // Get the bitmap table which is a table of byte bitmaps, nblocks many bits
     uint8 *bitmap = (uint8 *)((char *)map + sb->bmapstart * BSIZE);
 
+    // sb_log(sb, inodes_block_size, bitmaps_block_size, blockstart, nbitmaps);
+
+    check1(sb, inodes_block_size, bitmaps_block_size);
+
+    if (opts->advise) {
+        advise_regions(map, sb->inodestart, inodes_block_size);
+        advise_regions(map, sb->bmapstart, bitmaps_block_size);
+    }
+
+    check2(inode_table);
+
+    if (opts->level < LEVEL_INODES) {
+        return;
+    }
+
+    // Get the tracking arrays from one arena, they start zeroed
+    struct arena local, *arena = opts->arena ? opts->arena : &local;
+    uint nwords = ((sb->size + 1 > nbitmaps * 8 ? sb->size + 1 : nbitmaps * 8) + 63) / 64;
+    size_t arena_size = 2 * (size_t)nwords * sizeof(uint64_t) + 3 * (size_t)sb->ninodes * sizeof(uint)
+        + (size_t)sb->ninodes * sizeof(struct pent) + 6 * 64;
+    if (opts->arena) {
+        arena_reset(arena, arena_size, opts->huge_arena);
+    } else {
+        arena_init(arena, arena_size, opts->huge_arena);
+    }
+
+    // Load the on-disk bitmap into words, past its last block reads as free
+    uint64_t *bitmap_words = arena_alloc(arena, nwords * sizeof(uint64_t));
+    size_t bitmap_bytes = (size_t)bitmaps_block_size * BSIZE;
+    memcpy(bitmap_words, bitmap, nwords * 8 < bitmap_bytes ? nwords * 8 : bitmap_bytes);
+
     // Create a bitmap of used blocks from inodes
-    uint block_used[sb->size];
-    memset(block_used, 0, sizeof(block_used));
+    uint64_t *block_used = arena_alloc(arena, nwords * sizeof(uint64_t));
 
     // Record the used blocks until data blocks
     for (uint i = 0; i < blockstart; i++) {
-        block_used[i] = 1;
+        set_block(block_used, i);
     }
 
     // Create a bitmap of used inodes 
-    uint inode_used[sb->ninodes];
-    memset(inode_used, 0, sizeof(inode_used));
+    uint *inode_used = arena_alloc(arena, sb->ninodes * sizeof(uint));
 
     // Create a bitmap of inodes referred to in a dir
-    uint inode_refd[sb->ninodes];
-    memset(inode_refd, 0, sizeof(inode_refd));
+    uint *inode_refd = arena_alloc(arena, sb->ninodes * sizeof(uint));
     inode_refd[ROOTINO] = 1;
 
-    // sb_log(sb, inodes_block_size, bitmaps_block_size, blockstart, nbitmaps);
+    // Create the parent index of inodes referred to in a dir
+    struct pent *parents = arena_alloc(arena, sb->ninodes * sizeof(struct pent));
 
-    check1(sb, inodes_block_size, bitmaps_block_size);
-    check2(inode_table);
-    
-    for (uint i = 0; i < sb->ninodes; ++i) {
-        struct dinode *inode = &inode_table[i];
+    // Create the fragmentation counts if they are reported
+    uint *runs = opts->space ? arena_alloc(arena, sb->ninodes * sizeof(uint)) : NULL;
 
-        check3(inode);
+    struct xstate st = { map, sb, blockstart, block_used, inode_used, inode_refd, parents,
+                         img->holes, img->nholes, 0, NULL, runs, NULL, 0, 0, NULL, NULL };
 
-        // In use inodes
-        if (inode->type != 0) {
+    // Pick the reference counting engine
+    if (refs_engine(sb, opts) == REFS_SORT) {
+        grow_drefs(&st);
+    }
 
-            // Mark as used inode
-            inode_used[i] = 1;
+    if (opts->sample) {
+        sample_check(&st, inode_table, bitmap_words, opts);
+    } else if (opts->chain) {
+        chain_pass(&st, img, inode_table, opts);
+    } else {
+        for (uint i = next_inode(&st, inode_table, 0); i < sb->ninodes; i = next_inode(&st, inode_table, i + 1)) {
+            check_inode(&st, &inode_table[i], i, opts->level);
+        }
+    }
 
-            // Flags to mark "." and ".." dirents found if T_DIR
-            uint current_path_found = 0;
-            uint parent_path_found = 0;
+    st.scanned = sb->ninodes;
 
-            // Iterate through direct addresses of the inode
-            for (uint j = 0; j < NDIRECT; ++j) {
-                check4(sb, inode->addrs[j], blockstart);
-                check5(inode->addrs[j], block_used);
-                check6(map, inode->type, inode->addrs[j], i, inode_refd, &current_path_found, &parent_path_found);
+    if (opts->level >= LEVEL_FULL && !opts->sample) {
+        check7(bitmap_words, block_used, nbitmaps);
+        if (st.drefs) {
+            // Sort the references in place, with the one the root gets for free
+            add_dref(&st, ROOTINO);
+            uint *tmp = malloc(st.ndrefs * sizeof(uint));
+            if (!tmp) {
+                printf("reference sort allocation failed\n");
+                exit(1);
             }
+            radix_sort(st.drefs, tmp, st.ndrefs, sb->ninodes);
+            free(tmp);
+            check8v2(&st, inode_table, st.drefs, st.ndrefs, opts->emit_index != NULL);
+        } else {
+            check8(&st, inode_table);
+        }
+    }
 
-            check4(sb, inode->addrs[NDIRECT], blockstart);
-            check5(inode->addrs[NDIRECT], block_used);
-
-            // Check if inode has indirect addresses
-            if (inode->addrs[NDIRECT] != 0) {
-
-                // Fetch the indirect addresses
-                uint *indirect_addrs = (uint *) ((char *)map + inode->addrs[NDIRECT] * BSIZE);
-                check4v3(indirect_addrs);
+    // The index and the report use the parent index
+    if (st.drefs && (opts->space || opts->emit_index)) {
+        index_rest(&st);
+    }
 
-                // Iterate through the indirect addresses
-                for (uint j = 0; j < NINDIRECT; ++j) {
-                    check4v2(sb, indirect_addrs[j], blockstart);
-                    check5v2(indirect_addrs[j], block_used);
-                    check6(map, inode->type, indirect_addrs[j], i, inode_refd, &current_path_found, &parent_path_found);
-                }
-            }
+    if (opts->space) {
+        space_report(&st, inode_table, bitmap_words);
+    }
 
-            check6v2(inode, current_path_found, parent_path_found);
-        }
+    if (opts->emit_index) {
+        emit_index(&st, inode_table, opts->emit_index);
     }
 
-    check7(bitmap, block_used, nbitmaps);
-    check8(sb,inode_table, inode_used, inode_refd);
+    free(st.drefs);
+    if (!opts->arena) {
+        arena_free(arena);
+    }
 }
 
-int main(int argc, char *argv[]) {
-
-    // Read the optional repair flag
-    int repair_flag = 0;
-    int c;
-    while ((c = getopt(argc, argv, "r")) != -1) {
-        switch (c) {
-        case 'r':
-            printf("repair flag is set\n");
-            repair_flag = 1;
-            break;
-        default:
-            printf("repair flag is not set\n");
-            break;
-        }
+/*
+ * Find the holes of a sparse filesystem image
+ * Walk the allocated extents of the image file with SEEK_DATA/SEEK_HOLE and
+ * return a map with one byte per block, set for the blocks that lie entirely
+ * in a hole. Returns NULL if the underlying filesystem cannot report holes.
+ */
+uint8 *map_holes(int fd, off_t size, uint *nholes) {
+    *nholes = size / BSIZE + (size % BSIZE != 0);
+    uint8 *holes = malloc(*nholes);
+    if (!holes) {
+        return NULL;
     }
+    memset(holes, 1, *nholes);
 
-    // Validate number of args
-    if (argc != 2 + repair_flag) {
-        printf("usage: xcheck [-r | optional repair flag] [xv6 filesystem image]\n");
-        exit(1);
-    }
+    off_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data == -1) {
+            if (errno == ENXIO) {
+                // No data past pos
+                break;
+            }
+            free(holes);
+            return NULL;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1) {
+            free(holes);
+            return NULL;
+        }
 
-    // Open the filesystem image
-    char *fs_img = argv[optind];
-    int fd = open(fs_img, O_RDONLY);
-    if (fd == -1) {
-        printf("file open failed with errno %d\n", errno);
-        exit(1);
+        // Every block overlapping [data, hole) holds data
+        for (off_t b = data / BSIZE; b * BSIZE < hole; ++b) {
+            holes[b] = 0;
+        }
+        pos = hole;
     }
+    return holes;
+}
 
+/*
+ * Map a filesystem image open as fd, and find its holes
+ * Takes over fd, and exits on failure as there is nothing to check without
+ * the image.
+ */
+void map_image(int fd, struct xopts *opts, struct ximage *img) {
     // Get stat of filesystem image
     struct stat stat;
     if(fstat(fd, &stat) != 0) {
@@ -373,25 +1633,872 @@ int main(int argc, char *argv[]) {
         close(fd);
         exit(1);
     }
+    img->size = stat.st_size;
 
     // Map the filesystem image to the virtual address space
-    void *file_map  = mmap(NULL, stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    if (file_map == MAP_FAILED) {
+    int flags = MAP_SHARED | (opts->populate ? MAP_POPULATE : 0);
+    img->map = mmap(NULL, img->size, PROT_READ, flags, fd, 0);
+    if (img->map == MAP_FAILED) {
         close(fd);
         printf("mmap failed with errno %d\n", errno);
         exit(1);
     }
 
+    // Find the holes before closing the file
+    img->holes = map_holes(fd, img->size, &img->nholes);
+
     // Close file since we mapped
     close(fd);
+}
 
-    // Core
-    xcheck(file_map);
+/*
+ * Open and map a filesystem image by path
+ */
+void open_image(const char *fs_img, struct xopts *opts, struct ximage *img) {
+    // Open the filesystem image
+    int fd = open(fs_img, O_RDONLY);
+    if (fd == -1) {
+        printf("file open failed with errno %d\n", errno);
+        exit(1);
+    }
+    map_image(fd, opts, img);
+}
+
+void close_image(struct ximage *img) {
+    free(img->holes);
 
     // Unmap
-    if (munmap(file_map, stat.st_size) != 0) {
+    if (munmap(img->map, img->size) != 0) {
         printf("munmap failed with errno %d\n", errno);
         exit(1);
     }
+}
+
+/*
+ * Result cache
+ * A check is a pure function of the metadata it reads and of the checker,
+ * so its verdict and output are stored under a hash of exactly that: the
+ * checker version, the options that change the output, the image size, the
+ * superblock, inode table and bitmap, and the directory and indirect blocks
+ * the inodes point at. The hash pass only bounds checks the addresses it
+ * follows, it does not validate anything, so a hit skips every check phase.
+ */
+struct xcache {
+    char path[PATH_MAX];  // entry for the running check, empty when not caching
+    int capture;          // file the output of the check is captured in
+    int out, err;         // the original stdout and stderr
+};
+
+static struct xcache cache;
+
+// Set while the service runs a check, so that a verdict returns to it
+static jmp_buf *verdict;
+
+/*
+ * Four lane multiply-rotate hash, so that consecutive words do not depend
+ * on each other and the hash keeps up with the memory it reads.
+ */
+struct xhash {
+    uint64_t lane[4];
+};
+
+#define HASH_P1 0x9e3779b185ebca87ULL
+#define HASH_P2 0xc2b2ae3d27d4eb4fULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static void hash_words(struct xhash *h, const uint64_t *words, size_t n) {
+    for (size_t k = 0; k + 4 <= n; k += 4) {
+        for (uint l = 0; l < 4; ++l) {
+            h->lane[l] = rotl64(h->lane[l] + words[k + l] * HASH_P2, 31) * HASH_P1;
+        }
+    }
+}
+
+/*
+ * Whether block addr lies entirely in the image file. The address is widened
+ * first, so that an address near UINT_MAX cannot wrap around to a small one.
+ */
+static inline int in_file(struct ximage *img, uint64_t addr) {
+    return addr < (uint64_t)img->size / BSIZE;
+}
+
+/*
+ * Hash block addr of the image if it lies in the file. All-zero blocks,
+ * which make up most of the inode table of a typical image, and blocks in a
+ * hole are hashed as a single token instead of word by word.
+ */
+static void hash_block(struct xhash *h, struct ximage *img, uint addr) {
+    static const uint64_t zero_token[4] = { 0x7a65726f626c6bULL, 0, 0, 0 };
+    if (addr == 0 || !in_file(img, addr)) {
+        return;
+    }
+    if (img->holes && addr < img->nholes && img->holes[addr]) {
+        hash_words(h, zero_token, 4);
+        return;
+    }
+    const uint64_t *words = (uint64_t *)((char *)img->map + (size_t)addr * BSIZE);
+    uint64_t acc = 0;
+    for (uint k = 0; k < BSIZE / sizeof(uint64_t); ++k) {
+        acc |= words[k];
+    }
+    hash_words(h, acc ? words : zero_token, acc ? BSIZE / sizeof(uint64_t) : 4);
+}
+
+/*
+ * Hash the indirect block ind, and the blocks it holds for a directory.
+ */
+static void hash_indirect(struct xhash *h, struct ximage *img, uint ind, int dir) {
+    if (ind == 0 || !in_file(img, ind)) {
+        return;
+    }
+    hash_block(h, img, ind);
+    uint *indirect_addrs = (uint *) ((char *)img->map + (size_t)ind * BSIZE);
+    for (uint j = 0; dir && j < NINDIRECT; ++j) {
+        hash_block(h, img, indirect_addrs[j]);
+    }
+}
+
+/*
+ * Hash the blocks of an inode that the checks read: its indirect blocks,
+ * and its data blocks for a directory.
+ */
+static void hash_inode(struct xhash *h, struct ximage *img, struct dinode *inode, int dir) {
+    for (uint j = 0; dir && j < bmap.ndirect; ++j) {
+        hash_block(h, img, inode->addrs[j]);
+    }
+    hash_indirect(h, img, inode->addrs[bmap.ndirect], dir);
+    uint root = bmap.dindirect ? inode->addrs[bmap.dindirect] : 0;
+    if (root != 0 && in_file(img, root)) {
+        hash_block(h, img, root);
+        uint *l1 = (uint *) ((char *)img->map + (size_t)root * BSIZE);
+        for (uint j = 0; j < NINDIRECT; ++j) {
+            hash_indirect(h, img, l1[j], dir);
+        }
+    }
+}
+
+/*
+ * Compute the cache key of a check of img as 32 hex digits.
+ */
+void cache_key(struct ximage *img, struct xopts *opts, char key[33]) {
+    struct xhash h = { { HASH_P1, HASH_P2, ~HASH_P1, ~HASH_P2 } };
+    uint64_t head[8] = { XCHECK_VERSION, opts->level, opts->space, img->size, bmap.ndirect, bmap.dindirect };
+    hash_words(&h, head, 8);
+
+    if (img->size >= 2 * BSIZE) {
+        struct superblock *sb = (struct superblock *) ((char *)img->map + BSIZE);
+        hash_block(&h, img, 1);
+
+        // Inode table and bitmap, as far as they lie in the file
+        uint inodes_block_size = ((uint64_t)sb->ninodes * sizeof(struct dinode) + BSIZE - 1) / BSIZE;
+        for (uint b = 0; b < inodes_block_size; ++b) {
+            hash_block(&h, img, sb->inodestart + b);
+        }
+        uint bitmaps_block_size = ((uint64_t)sb->nblocks / 8 + 1 + BSIZE - 1) / BSIZE;
+        for (uint b = 0; b < bitmaps_block_size; ++b) {
+            hash_block(&h, img, sb->bmapstart + b);
+        }
+
+        // Directory and indirect blocks of the inodes in the file
+        for (uint i = 0; i < sb->ninodes; ++i) {
+            if (!in_file(img, (uint64_t)sb->inodestart + i / IPB)) {
+                break;
+            }
+            struct dinode *inode = (struct dinode *)((char *)img->map + (size_t)sb->inodestart * BSIZE) + i;
+            if (inode->type == 0) {
+                continue;
+            }
+            hash_inode(&h, img, inode, inode->type == T_DIR);
+        }
+    }
+
+    uint64_t k0 = h.lane[0] ^ rotl64(h.lane[2], 17);
+    uint64_t k1 = h.lane[1] ^ rotl64(h.lane[3], 17);
+    snprintf(key, 33, "%016llx%016llx", (unsigned long long)k0, (unsigned long long)k1);
+}
+
+/*
+ * Look the check up in the cache. On a hit, replay the stored output, set
+ * status to the stored verdict and return 1, on a miss return 0.
+ */
+int cache_lookup(const char *path, int *status) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    char line[64];
+    int version = 0;
+    if (!fgets(line, sizeof(line), f) || sscanf(line, "xcheck-cache %d", &version) != 1
+        || !fgets(line, sizeof(line), f) || sscanf(line, "status %d", status) != 1
+        || version != XCHECK_VERSION) {
+        fclose(f);
+        return 0;
+    }
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        fwrite(buf, 1, n, *status ? stderr : stdout);
+    }
+    fclose(f);
+    return 1;
+}
+
+void cache_abort(void);
+
+/*
+ * Start capturing the output of the check for the cache entry at path.
+ * Caching is skipped if the capture file cannot be made.
+ */
+void cache_begin(const char *dir, const char *path) {
+    static int registered;
+    if (!registered) {
+        atexit(cache_abort);
+        registered = 1;
+    }
+    char capture[PATH_MAX];
+    snprintf(capture, sizeof(capture), "%s/.capture.XXXXXX", dir);
+    fflush(stdout);
+    cache.capture = mkstemp(capture);
+    if (cache.capture == -1) {
+        return;
+    }
+    unlink(capture);
+    cache.out = dup(STDOUT_FILENO);
+    cache.err = dup(STDERR_FILENO);
+    dup2(cache.capture, STDOUT_FILENO);
+    dup2(cache.capture, STDERR_FILENO);
+    snprintf(cache.path, sizeof(cache.path), "%s", path);
+}
+
+/*
+ * Stop capturing, replay the captured output, and store it with the verdict
+ * if store is set. The entry is written to a temporary file and renamed in
+ * place, so that concurrent checks of the same image never see a partial
+ * entry.
+ */
+static void cache_end(int status, int store) {
+    if (!cache.path[0]) {
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    dup2(cache.out, STDOUT_FILENO);
+    dup2(cache.err, STDERR_FILENO);
+    close(cache.out);
+    close(cache.err);
+
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", cache.path, getpid());
+    FILE *f = store ? fopen(tmp, "w") : NULL;
+    if (f) {
+        fprintf(f, "xcheck-cache %d\nstatus %d\n", XCHECK_VERSION, status);
+    }
+
+    char buf[4096];
+    ssize_t n;
+    lseek(cache.capture, 0, SEEK_SET);
+    while ((n = read(cache.capture, buf, sizeof(buf))) > 0) {
+        fwrite(buf, 1, n, status ? stderr : stdout);
+        if (f) {
+            fwrite(buf, 1, n, f);
+        }
+    }
+    close(cache.capture);
+
+    if (f && fclose(f) == 0 && n == 0) {
+        rename(tmp, cache.path);
+    } else if (store) {
+        unlink(tmp);
+    }
+    cache.path[0] = '\0';
+}
+
+void cache_commit(int status) {
+    cache_end(status, 1);
+}
+
+/*
+ * Exits that skip finish(), such as failed allocations, end a capture
+ * without a verdict: their output is replayed but never cached.
+ */
+void cache_abort(void) {
+    cache_end(0, 0);
+}
+
+/*
+ * End the check with a verdict, 0 for a consistent image and 1 otherwise.
+ * In the service the verdict goes back to the worker that ran the check,
+ * otherwise it is the exit status of xcheck.
+ */
+void finish(int status) {
+    cache_commit(status);
+    if (verdict) {
+        longjmp(*verdict, status + 1);
+    }
+    exit(status);
+}
+
+/*
+ * Chain mode
+ * Checks an ordered list of similar images, such as successive snapshots,
+ * keeping the results of the per-inode checks of every inode table block.
+ * On the next image, a block whose key, over its own content and the
+ * indirect and directory blocks of its inodes, matches the one its results
+ * were recorded for is not checked again: the addresses and dirent
+ * references recorded for it are replayed into the block set and reference
+ * counts. Duplicate addresses, the bitmap and the reference counts (#5, #7,
+ * #8) are still checked in full on every image, as any change elsewhere can
+ * break them.
+ */
+static uint64_t fold_key(struct xhash *h) {
+    return h->lane[0] ^ rotl64(h->lane[1], 17) ^ rotl64(h->lane[2], 31) ^ rotl64(h->lane[3], 47);
+}
+
+static uint64_t group_key(struct ximage *img, struct superblock *sb, struct dinode *inode_table, uint g, int level) {
+    struct xhash h = { { HASH_P1, HASH_P2, ~HASH_P1, ~HASH_P2 } };
+    hash_block(&h, img, sb->inodestart + g);
+    uint last = (g + 1) * IPB < sb->ninodes ? (g + 1) * IPB : sb->ninodes;
+    for (uint i = g * IPB; i < last; ++i) {
+        struct dinode *inode = &inode_table[i];
+        if (inode->type != 0) {
+            hash_inode(&h, img, inode, inode->type == T_DIR && level >= LEVEL_DIRS);
+        }
+    }
+    return fold_key(&h);
+}
+
+/*
+ * Replay the results recorded for an unchanged inode table block, claiming
+ * its addresses in the order the walkers would.
+ */
+static void replay_group(struct xstate *st, struct xgroup *grp) {
+    uint *b = grp->blks, *end = b + grp->nblks;
+    while (b < end) {
+        uint i = b[0], n = b[1];
+        b += 2;
+        st->scanned = i;
+        st->inode_used[i] = 1;
+        for (uint j = 0; j < n; ++j) {
+            uint addr = b[j] & ~CLAIM_DIRECT;
+            if (test_block(st->block_used, addr)) {
+                die_inode(st, b[j] & CLAIM_DIRECT ? "direct address used more than once"
+                                                  : "indirect address used more than once", i);
+            }
+            set_block(st->block_used, addr);
+        }
+        b += n;
+    }
+    for (uint r = 0; r < grp->nrefs; ++r) {
+        struct dref *d = &grp->refs[r];
+        if (st->drefs) {
+            add_dref(st, d->inum);
+        } else {
+            st->inode_refd[d->inum]++;
+            st->parents[d->inum] = d->p;
+        }
+    }
+}
+
+static void chain_free(struct xchain *ch) {
+    for (uint g = 0; g < ch->ngroups; ++g) {
+        free(ch->groups[g].blks);
+        free(ch->groups[g].refs);
+    }
+    free(ch->groups);
+    memset(ch, 0, sizeof(*ch));
+}
+
+/*
+ * Inode pass of the chain mode, in place of the plain one in xcheck
+ */
+void chain_pass(struct xstate *st, struct ximage *img, struct dinode *inode_table, struct xopts *opts) {
+    struct xchain *ch = opts->chain;
+    struct superblock *sb = st->sb;
+
+    // Results of an image with another superblock cannot be reused
+    struct xhash h = { { HASH_P1, HASH_P2, ~HASH_P1, ~HASH_P2 } };
+    hash_block(&h, img, 1);
+    uint64_t sbkey = fold_key(&h);
+    if (!ch->groups || ch->sbkey != sbkey || ch->level != opts->level) {
+        chain_free(ch);
+        ch->sbkey = sbkey;
+        ch->level = opts->level;
+        ch->ngroups = (sb->ninodes + IPB - 1) / IPB;
+        ch->groups = calloc(ch->ngroups, sizeof(struct xgroup));
+        if (!ch->groups) {
+            printf("chain allocation failed\n");
+            exit(1);
+        }
+    }
+
+    ch->used = 0;
+    ch->reused = 0;
+    for (uint g = 0; g < ch->ngroups; ++g) {
+        struct xgroup *grp = &ch->groups[g];
+
+        // A block of free inodes has nothing to check or replay
+        uint last = (g + 1) * IPB < sb->ninodes ? (g + 1) * IPB : sb->ninodes;
+        uint used = 0;
+        for (uint i = g * IPB; i < last; ++i) {
+            used |= inode_table[i].type;
+        }
+        if (!used) {
+            continue;
+        }
+        ch->used++;
+
+        uint64_t key = group_key(img, sb, inode_table, g, opts->level);
+        if (grp->valid && grp->key == key) {
+            ch->reused++;
+            replay_group(st, grp);
+            continue;
+        }
+
+        // Check the inodes and record what the walkers claim and count
+        grp->valid = 0;
+        grp->nblks = 0;
+        grp->nrefs = 0;
+        st->log = grp;
+        for (uint i = g * IPB; i < last; ++i) {
+            if (inode_table[i].type != 0) {
+                uint head = grp->nblks;
+                push_blk(grp, i);
+                push_blk(grp, 0);
+                check_inode(st, &inode_table[i], i, opts->level);
+                grp->blks[head + 1] = grp->nblks - head - 2;
+            }
+        }
+        st->log = NULL;
+        grp->key = key;
+        grp->valid = 1;
+    }
+}
+
+/*
+ * Check the images of a chain in order and return the worst verdict. The
+ * verdict of a failed check returns here through finish(), so that the rest
+ * of the chain is still checked. The tracking arena is kept across the
+ * images as in the service.
+ */
+int check_chain(char **paths, int n, struct xopts *opts) {
+    struct xchain chain = {0};
+    struct arena arena;
+    arena_init(&arena, HUGESZ, opts->huge_arena);
+    opts->chain = &chain;
+    opts->arena = &arena;
+
+    int worst = 0;
+    for (int k = 0; k < n; ++k) {
+        printf("chain: %s\n", paths[k]);
+        fflush(stdout);
+
+        struct ximage img;
+        open_image(paths[k], opts, &img);
+        chain.used = 0;
+
+        jmp_buf env;
+        int status = setjmp(env);
+        if (status == 0) {
+            verdict = &env;
+            xcheck(&img, opts);
+        } else {
+            status--;
+        }
+        verdict = NULL;
+        fflush(stdout);
+        fflush(stderr);
+
+        if (chain.used) {
+            printf("chain: reused %u of %u inode blocks in use\n", chain.reused, chain.used);
+        }
+        close_image(&img);
+        worst = status > worst ? status : worst;
+    }
+
+    chain_free(&chain);
+    arena_free(&arena);
+    opts->chain = NULL;
+    opts->arena = NULL;
+    return worst;
+}
+
+/*
+ * Check a mapped image, answering from the cache when possible, and return
+ * the verdict. Failed checks end in finish().
+ */
+int run_check(struct ximage *img, struct xopts *opts) {
+    // Answer from the cache if possible, the index needs the full walk and
+    // a sample is cheaper than hashing the image
+    if (opts->cache_dir && !opts->emit_index && !opts->sample) {
+        char key[33], path[PATH_MAX];
+        int status;
+        cache_key(img, opts, key);
+        snprintf(path, sizeof(path), "%s/%s", opts->cache_dir, key);
+        if (cache_lookup(path, &status)) {
+            return status;
+        }
+        cache_begin(opts->cache_dir, path);
+    }
+
+    // Core
+    xcheck(img, opts);
+    cache_commit(0);
     return 0;
 }
+
+
+/*
+ * Receive the request line of a client, and the image descriptor if one
+ * was passed along with it. Returns the length of the line or -1.
+ */
+ssize_t recv_request(int conn, char *req, size_t size, int *fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { req, size - 1 };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    *fd = -1;
+    ssize_t n = recvmsg(conn, &msg, 0);
+    if (n <= 0) {
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    // Read the rest of the line if it came in pieces
+    while (n < (ssize_t)size - 1 && !memchr(req, '\n', n)) {
+        ssize_t r = read(conn, req + n, size - 1 - n);
+        if (r <= 0) {
+            break;
+        }
+        n += r;
+    }
+    req[n] = '\0';
+    req[strcspn(req, "\n")] = '\0';
+    return n;
+}
+
+/*
+ * Answer one request of a client on conn
+ * The output of the check goes to the client, and the verdict of a failing
+ * check comes back here through finish(). Returns the verdict, or -1 if the
+ * request could not be run.
+ */
+int serve_request(int conn, struct xopts *base) {
+    char req[XCHECKD_REQMAX];
+    int fd;
+    if (recv_request(conn, req, sizeof(req), &fd) < 0) {
+        return -1;
+    }
+
+    // Parse "check <path|fd> [level=N] [space]"
+    struct xopts opts = *base;
+    const char *bad = NULL;
+    char *save, *word = strtok_r(req, " ", &save);
+    char *target = strtok_r(NULL, " ", &save);
+    if (!word || strcmp(word, "check") != 0 || !target) {
+        bad = "bad request";
+    } else {
+        while ((word = strtok_r(NULL, " ", &save))) {
+            if (strncmp(word, "level=", 6) == 0) {
+                opts.level = atoi(word + 6);
+            } else if (strcmp(word, "space") == 0) {
+                opts.space = 1;
+            }
+        }
+        // Reject the options main would reject, on top of those of the service
+        if (opts.level < LEVEL_SUPER || opts.level > LEVEL_FULL) {
+            bad = "bad level";
+        } else if (opts.sample && (opts.space || opts.level < LEVEL_INODES)) {
+            bad = "bad request";
+        } else if (strcmp(target, "fd") == 0 ? fd < 0 : target[0] != '/') {
+            bad = "bad image, pass an absolute path or a descriptor";
+        }
+    }
+    if (bad) {
+        dprintf(conn, "%s\n", bad);
+    }
+    if (fd >= 0 && (bad || strcmp(target, "fd") != 0)) {
+        close(fd);
+    }
+    if (bad) {
+        return -1;
+    }
+    if (strcmp(target, "fd") != 0) {
+        fd = open(target, O_RDONLY);
+        if (fd == -1) {
+            dprintf(conn, "file open failed with errno %d\n", errno);
+            return -1;
+        }
+    }
+
+    // Send the output of the check to the client
+    fflush(stdout);
+    fflush(stderr);
+    dup2(conn, STDOUT_FILENO);
+    dup2(conn, STDERR_FILENO);
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status == 0) {
+        verdict = &env;
+        struct ximage img;
+        map_image(fd, &opts, &img);
+        status = run_check(&img, &opts);
+        close_image(&img);
+    } else {
+        status--;
+    }
+    verdict = NULL;
+    fflush(stdout);
+    fflush(stderr);
+    return status;
+}
+
+/*
+ * Worker of the service
+ * Takes connections off the shared listening socket one at a time. Its
+ * tracking arena is sized and faulted in up front and reused by every
+ * check. A failed check returns in the middle of xcheck and may leave
+ * allocations behind, so the worker exits after answering it and the
+ * service starts a fresh one.
+ */
+void worker(int lfd, size_t arena_size, struct xopts *opts) {
+    struct arena arena;
+    arena_init(&arena, arena_size, opts->huge_arena);
+    memset(arena.base, 0, arena.size);
+    opts->arena = &arena;
+
+    int null = open("/dev/null", O_WRONLY);
+    for (;;) {
+        int conn = accept(lfd, NULL, NULL);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            exit(1);
+        }
+        int status = serve_request(conn, opts);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (status >= 0) {
+            dprintf(conn, "status %d\n", status);
+        }
+        close(conn);
+        if (status > 0) {
+            exit(0);
+        }
+    }
+}
+
+/*
+ * Resident checker service
+ * Listens on a Unix socket and keeps nworkers workers running, which is
+ * also the number of checks run at once, further clients wait in the
+ * listen backlog. Never returns.
+ */
+void serve(const char *sock, int nworkers, size_t arena_mb, struct xopts *opts) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock) >= sizeof(addr.sun_path)) {
+        printf("socket path too long\n");
+        exit(1);
+    }
+    strcpy(addr.sun_path, sock);
+
+    // Replace the socket an earlier service left behind, but no other file
+    struct stat stat;
+    if (lstat(sock, &stat) == 0 && S_ISSOCK(stat.st_mode)) {
+        unlink(sock);
+    }
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd == -1 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 128) != 0) {
+        printf("socket setup failed with errno %d\n", errno);
+        exit(1);
+    }
+
+    // Clients that hang up must not kill a worker
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t *pids = calloc(nworkers, sizeof(pid_t));
+    for (;;) {
+        for (int w = 0; w < nworkers; ++w) {
+            if (pids[w] > 0) {
+                continue;
+            }
+            pids[w] = fork();
+            if (pids[w] == 0) {
+                worker(lfd, arena_mb << 20, opts);
+            }
+        }
+        pid_t pid = wait(NULL);
+        for (int w = 0; w < nworkers; ++w) {
+            if (pids[w] == pid) {
+                pids[w] = 0;
+            }
+        }
+    }
+}
+
+/*
+ * Report the wall time and page faults of the run so far, for comparing
+ * the mapping and arena options on a host.
+ */
+void report_stats(struct timespec *start) {
+    struct timespec end;
+    struct rusage usage;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &usage);
+    double ms = (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+    printf("time: %.3f ms minflt: %ld majflt: %ld\n", ms, usage.ru_minflt, usage.ru_majflt);
+}
+
+int main(int argc, char *argv[]) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Read the optional flags
+    struct xopts opts = {0};
+    opts.level = LEVEL_FULL;
+    char *daemon_sock = NULL;
+    int chain = 0;
+    int bad_args = 0;
+    int workers = 4;
+    size_t arena_mb = 16;
+    static struct option long_opts[] = {
+        { "emit-index", required_argument, NULL, 'i' },
+        { "space", no_argument, NULL, 'S' },
+        { "level", required_argument, NULL, 'l' },
+        { "cache", required_argument, NULL, 'c' },
+        { "refs", required_argument, NULL, 'R' },
+        { "daemon", optional_argument, NULL, 'D' },
+        { "workers", required_argument, NULL, 'j' },
+        { "arena", required_argument, NULL, 'A' },
+        { "sample", required_argument, NULL, 'P' },
+        { "seed", required_argument, NULL, 'E' },
+        { "chain", no_argument, NULL, 'C' },
+        { "dindirect", no_argument, NULL, 'd' },
+        { 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "rpmHsdi:Sl:c:R:D::j:A:", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'r':
+            printf("repair flag is set\n");
+            opts.repair = 1;
+            break;
+        case 'p':
+            opts.populate = 1;
+            break;
+        case 'm':
+            opts.advise = 1;
+            break;
+        case 'H':
+            opts.huge_arena = 1;
+            break;
+        case 's':
+            opts.stats = 1;
+            break;
+        case 'i':
+            opts.emit_index = optarg;
+            break;
+        case 'S':
+            opts.space = 1;
+            break;
+        case 'l':
+            opts.level = atoi(optarg);
+            break;
+        case 'c':
+            opts.cache_dir = optarg;
+            break;
+        case 'D':
+            daemon_sock = optarg ? optarg : XCHECKD_SOCKET;
+            break;
+        case 'j':
+            workers = atoi(optarg);
+            break;
+        case 'A':
+            arena_mb = atoi(optarg);
+            break;
+        case 'P':
+            opts.sample = strtod(optarg, NULL);
+            if (opts.sample <= 0 || opts.sample > 100) {
+                bad_args = 1;
+            }
+            break;
+        case 'd':
+            bmap = (struct xbmap){ NADDRS - 2, NADDRS - 1 };
+            break;
+        case 'C':
+            chain = 1;
+            break;
+        case 'E':
+            opts.seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'R':
+            opts.refs = strcmp(optarg, "array") == 0 ? REFS_ARRAY
+                : strcmp(optarg, "sort") == 0 ? REFS_SORT
+                : strcmp(optarg, "auto") == 0 ? REFS_AUTO : -1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    // Validate number of args
+    if (bad_args || (chain ? argc - optind < 1 : argc - optind != !daemon_sock) || workers < 1 || opts.level < LEVEL_SUPER || opts.level > LEVEL_FULL
+        || (opts.emit_index && opts.level != LEVEL_FULL) || opts.refs < 0
+        || (opts.sample && (opts.emit_index || opts.space || opts.level < LEVEL_INODES))
+        || (chain && (opts.emit_index || opts.space || opts.sample || opts.cache_dir || daemon_sock))
+        || (daemon_sock && opts.emit_index)) {
+        printf("usage: xcheck [-r] [-p] [-m] [-H] [-s] [-S] [-d] [-l level] [-c cachedir] [--refs engine] [--sample P [--seed N]] [--emit-index out.idx] [xv6 filesystem image]\n");
+        printf("       xcheck --chain [-l level] [options] [xv6 filesystem image]...\n");
+        printf("       xcheck -D[socket] [-j workers] [-A arena MB] [options]\n");
+        printf("  -r  repair flag\n");
+        printf("  -p  prefault the image mapping (MAP_POPULATE)\n");
+        printf("  -m  advise huge pages and sequential access on inode table and bitmap\n");
+        printf("  -H  allocate tracking arrays from a huge-page-backed arena\n");
+        printf("  -s  report time and page faults\n");
+        printf("  -S, --space  report space usage, free extents and fragmentation\n");
+        printf("  -d, --dindirect  the last address of an inode is a double-indirect block\n");
+        printf("  -l, --level N  run checks up to level N: 1 superblock, 2 inodes, 3 directories, 4 all (default)\n");
+        printf("  -c, --cache dir  reuse results of identical images from a cache in dir\n");
+        printf("  --refs array|sort|auto  reference counting engine, auto picks by cache size\n");
+        printf("  --sample P  check a random P%% of the inodes in use and estimate the corruption rate\n");
+        printf("  --seed N  seed of the sample, default 0\n");
+        printf("  --chain  check similar images in order, reusing the results of unchanged inode blocks\n");
+        printf("  -D, --daemon[=socket]  serve checks for xcheckc on a Unix socket, default %s\n", XCHECKD_SOCKET);
+        printf("  -j, --workers N  checks the service runs at once, default 4\n");
+        printf("  -A, --arena MB  tracking arena each worker keeps warm, default 16\n");
+        printf("  -i, --emit-index out.idx  write a metadata index for xquery after a full clean check\n");
+        exit(1);
+    }
+
+    if (daemon_sock) {
+        serve(daemon_sock, workers, arena_mb, &opts);
+    }
+
+    int status;
+    if (chain) {
+        status = check_chain(argv + optind, argc - optind, &opts);
+    } else {
+        struct ximage img;
+        open_image(argv[optind], &opts, &img);
+        status = run_check(&img, &opts);
+        close_image(&img);
+    }
+
+    if (opts.stats) {
+        report_stats(&start);
+    }
+    return status;
+}
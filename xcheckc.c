@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "xcheckd.h"
+
+/*
+ * Send the request line, passing fd along with it if it is not -1.
+ */
+int send_request(int sock, const char *req, int fd) {
+    struct iovec iov = { (void *)req, strlen(req) };
+    struct msghdr msg = {0};
+    char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    return sendmsg(sock, &msg, 0) == (ssize_t)iov.iov_len ? 0 : -1;
+}
+
+/*
+ * Client of the resident checker, see xcheckd.h
+ * Prints what the check printed, to stdout for a consistent image and to
+ * stderr otherwise, and exits with the verdict, or 2 if the service could
+ * not run the check.
+ */
+int main(int argc, char *argv[]) {
+    const char *sockpath = XCHECKD_SOCKET;
+    int level = 0, pass_fd = 0, space = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "D:l:fS")) != -1) {
+        switch (opt) {
+        case 'D':
+            sockpath = optarg;
+            break;
+        case 'l':
+            level = atoi(optarg);
+            break;
+        case 'f':
+            pass_fd = 1;
+            break;
+        case 'S':
+            space = 1;
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (argc - optind != 1) {
+        printf("usage: xcheckc [-D socket] [-l level] [-S] [-f] [xv6 filesystem image]\n");
+        printf("  -D socket  socket of the service, as xcheck -D, default %s\n", XCHECKD_SOCKET);
+        printf("  -l level  check level, as xcheck -l\n");
+        printf("  -S  report space usage, as xcheck -S\n");
+        printf("  -f  pass the open image instead of its path\n");
+        exit(2);
+    }
+
+    // Name the image, or open it here so the service needs no access to it
+    char req[XCHECKD_REQMAX], path[PATH_MAX];
+    int fd = -1;
+    if (pass_fd) {
+        fd = open(argv[optind], O_RDONLY);
+        if (fd == -1) {
+            printf("file open failed with errno %d\n", errno);
+            exit(2);
+        }
+        strcpy(path, "fd");
+    } else if (!realpath(argv[optind], path)) {
+        printf("file open failed with errno %d\n", errno);
+        exit(2);
+    }
+    int len = snprintf(req, sizeof(req), "check %s", path);
+    if (level) {
+        len += snprintf(req + len, sizeof(req) - len, " level=%d", level);
+    }
+    if (space) {
+        len += snprintf(req + len, sizeof(req) - len, " space");
+    }
+    snprintf(req + len, sizeof(req) - len, "\n");
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+        printf("socket path too long\n");
+        exit(2);
+    }
+    strcpy(addr.sun_path, sockpath);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        printf("connect failed with errno %d\n", errno);
+        exit(2);
+    }
+    if (send_request(sock, req, fd) != 0) {
+        printf("send failed with errno %d\n", errno);
+        exit(2);
+    }
+
+    // Collect the answer, the verdict is on its last line
+    size_t size = 4096, used = 0;
+    char *out = malloc(size);
+    ssize_t n;
+    while ((n = read(sock, out + used, size - used - 1)) > 0) {
+        used += n;
+        if (used == size - 1) {
+            size *= 2;
+            out = realloc(out, size);
+        }
+    }
+    out[used] = '\0';
+
+    int status = 2;
+    char *last = used > 1 ? out + used - 1 : out;
+    while (last > out && last[-1] != '\n') {
+        last--;
+    }
+    if (sscanf(last, "status %d", &status) == 1) {
+        *last = '\0';
+    } else {
+        status = 2;
+    }
+    fputs(out, status == 0 ? stdout : stderr);
+    return status;
+}
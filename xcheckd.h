@@ -0,0 +1,21 @@
+/*
+ * Protocol between the resident checker (xcheck -D) and xcheckc
+ * A client connects to the Unix socket of the service and sends a single
+ * request line, either naming the image by absolute path, or passing an
+ * open descriptor of it in an SCM_RIGHTS message along with the line:
+ *   check <path> [level=N] [space]
+ *   check fd [level=N] [space]
+ * The service answers with the output of the check, the same lines xcheck
+ * prints, followed by a last line holding the verdict, 0 for a consistent
+ * image and 1 otherwise:
+ *   status <verdict>
+ * and closes the connection. A connection closed without a status line
+ * means the check could not be run.
+ */
+#ifndef XCHECKD_H
+#define XCHECKD_H
+
+#define XCHECKD_SOCKET "/tmp/xcheckd.sock"
+#define XCHECKD_REQMAX 4200
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * Metadata index written by xcheck --emit-index and read by xquery
+ * Every section is an array of fixed size records at an 8 byte aligned
+ * offset given in the header, so a reader can mmap the file and use the
+ * sections in place. Integers are in host byte order. Readers must check
+ * magic and version before touching any section.
+ */
+#ifndef XINDEX_H
+#define XINDEX_H
+
+#include <stdint.h>
+
+#define XIDX_MAGIC   0x58444958  // "XIDX"
+#define XIDX_VERSION 2
+
+struct xidx_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t fssize;    // blocks in the image, records in owner
+    uint32_t ninodes;   // used inodes, records in inodes and bysize
+    uint32_t nblocks;   // records in blocks
+    uint32_t ndirents;  // records in dirents
+    uint32_t namesz;    // bytes in names
+    uint32_t reserved;
+    uint64_t inodes;    // section offsets from the start of the file
+    uint64_t blocks;
+    uint64_t owner;
+    uint64_t bysize;
+    uint64_t dirents;
+    uint64_t names;
+};
+
+/*
+ * Summary of a used inode, sorted by inum
+ * The data blocks of inode k are blocks[inodes[k].blk .. inodes[k + 1].blk)
+ * in file order, and the dirents of a directory are dirents[inodes[k].dir ..
+ * inodes[k + 1].dir), the last inode ending at nblocks and ndirents.
+ */
+struct xidx_inode {
+    uint32_t inum;
+    int16_t type;
+    int16_t nlink;
+    uint32_t size;
+    uint32_t refs;      // dirents referring to the inode
+    uint32_t indirect;  // indirect block, 0 if none
+    uint32_t dindirect; // double-indirect block, 0 if none
+    uint32_t blk;
+    uint32_t dir;
+    uint32_t parent;    // directory naming the inode, itself for the root
+    uint32_t name;      // offset of its name in names
+};
+
+// Directory entry, name is an offset of a NUL terminated string in names
+struct xidx_dirent {
+    uint32_t inum;
+    uint32_t name;
+};
+
+// owner[b] is the inum owning block b, 0 if the block is free or metadata
+// bysize[k] is an index in inodes, sorted by size
+
+#endif
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Round-trip the metadata index: emit it with each reference counting
+# engine, then check that xquery resolves every root entry back to its
+# name and every listed block back to its inode.
+# usage: ./xindex_test.sh [xv6 filesystem image]...
+
+if [ $# -eq 0 ]; then
+    echo "usage: xindex_test.sh [xv6 filesystem image]..."
+    exit 1
+fi
+
+idx=${TMPDIR:-/tmp}/xindex_test.$$
+trap 'rm -f "$idx" "$idx.sort"' EXIT
+fail=0
+
+for img in "$@"; do
+    if ! ./xcheck --refs=array --emit-index="$idx" "$img" >/dev/null \
+        || ! ./xcheck --refs=sort --emit-index="$idx.sort" "$img" >/dev/null; then
+        echo "$img: emit failed"
+        fail=1
+        continue
+    fi
+    if ! cmp -s "$idx" "$idx.sort"; then
+        echo "$img: index differs between reference counting engines"
+        fail=1
+    fi
+    ./xquery "$idx" ls 1 | while read inum name; do
+        [ "$name" = "." ] || [ "$name" = ".." ] && continue
+        path=$(./xquery "$idx" inode "$inum" | head -n 1 | cut -d ' ' -f 4)
+        if [ "$path" != "/$name" ]; then
+            echo "$img: inode $inum resolves to $path, not /$name"
+            exit 1
+        fi
+        for b in $(./xquery "$idx" inode "$inum" | sed -n 's/^blocks//p'); do
+            owner=$(./xquery "$idx" owner "$b" | cut -d ' ' -f 1)
+            if [ "$owner" != "$inum" ]; then
+                echo "$img: block $b owned by $owner, not $inum"
+                exit 1
+            fi
+        done
+    done || fail=1
+done
+
+[ $fail -eq 0 ] && echo "index round trip ok"
+exit $fail
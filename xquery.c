@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "xv6-riscv/kernel/fs.h"
+#include "xv6-riscv/kernel/param.h"
+#include "xv6-riscv/kernel/types.h"
+
+#include "xindex.h"
+
+#define die(msg) do { fprintf(stderr, "ERROR: %s\n", msg); exit(1); } while (0)
+
+/*
+ * Sections of a mapped index
+ */
+struct xidx {
+    struct xidx_header *h;
+    struct xidx_inode *inodes;
+    uint32_t *blocks;
+    uint32_t *owner;
+    uint32_t *bysize;
+    struct xidx_dirent *dirents;
+    char *names;
+};
+
+/*
+ * Find the summary of inode inum by binary search, NULL if it is not used.
+ */
+struct xidx_inode *find_inode(struct xidx *x, uint32_t inum) {
+    uint32_t lo = 0, hi = x->h->ninodes;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (x->inodes[mid].inum < inum) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < x->h->ninodes && x->inodes[lo].inum == inum) {
+        return &x->inodes[lo];
+    }
+    return NULL;
+}
+
+/*
+ * End of the CSR rows of inode k in the block and dirent sections.
+ */
+uint32_t blk_end(struct xidx *x, struct xidx_inode *in) {
+    return in + 1 < x->inodes + x->h->ninodes ? in[1].blk : x->h->nblocks;
+}
+
+uint32_t dir_end(struct xidx *x, struct xidx_inode *in) {
+    return in + 1 < x->inodes + x->h->ninodes ? in[1].dir : x->h->ndirents;
+}
+
+/*
+ * Print the path of an inode by following its parents up to the root.
+ */
+void print_path(struct xidx *x, struct xidx_inode *in, uint depth) {
+    if (in->parent == in->inum || depth >= MAXPATH) {
+        return;
+    }
+    struct xidx_inode *parent = find_inode(x, in->parent);
+    if (parent) {
+        print_path(x, parent, depth + 1);
+    }
+    printf("/%s", x->names + in->name);
+}
+
+void print_inode(struct xidx *x, struct xidx_inode *in) {
+    static const char *types[] = { "free", "dir", "file", "device" };
+    printf("%u %s %u ", in->inum, in->type >= 0 && in->type <= T_DEVICE ? types[in->type] : "?", in->size);
+    if (in->inum == ROOTINO) {
+        printf("/");
+    }
+    print_path(x, in, 0);
+    printf("\n");
+}
+
+void query_inode(struct xidx *x, uint32_t inum) {
+    struct xidx_inode *in = find_inode(x, inum);
+    if (!in) {
+        die("inode not in use");
+    }
+    print_inode(x, in);
+    printf("nlink %d refs %u indirect %u dindirect %u\n", in->nlink, in->refs, in->indirect, in->dindirect);
+    printf("blocks");
+    for (uint32_t b = in->blk; b < blk_end(x, in); ++b) {
+        printf(" %u", x->blocks[b]);
+    }
+    printf("\n");
+}
+
+void query_owner(struct xidx *x, uint32_t block) {
+    if (block >= x->h->fssize) {
+        die("block out of range");
+    }
+    if (x->owner[block] == 0) {
+        printf("block %u is free or metadata\n", block);
+        return;
+    }
+    print_inode(x, find_inode(x, x->owner[block]));
+}
+
+void query_larger(struct xidx *x, uint32_t size) {
+    // First inode larger than size in the size order
+    uint32_t lo = 0, hi = x->h->ninodes;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (x->inodes[x->bysize[mid]].size <= size) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < x->h->ninodes; ++lo) {
+        struct xidx_inode *in = &x->inodes[x->bysize[lo]];
+        if (in->type == T_FILE) {
+            print_inode(x, in);
+        }
+    }
+}
+
+void query_ls(struct xidx *x, uint32_t inum) {
+    struct xidx_inode *in = find_inode(x, inum);
+    if (!in || in->type != T_DIR) {
+        die("not a directory");
+    }
+    for (uint32_t d = in->dir; d < dir_end(x, in); ++d) {
+        printf("%u %s\n", x->dirents[d].inum, x->names + x->dirents[d].name);
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    // Validate number of args
+    if (argc != 4) {
+        printf("usage: xquery [index] [query] [arg]\n");
+        printf("  inode INUM    summary, path and blocks of an inode\n");
+        printf("  owner BLOCK   inode owning a block\n");
+        printf("  larger BYTES  files larger than BYTES\n");
+        printf("  ls INUM       entries of a directory\n");
+        exit(1);
+    }
+
+    // Open the index
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1) {
+        printf("file open failed with errno %d\n", errno);
+        exit(1);
+    }
+
+    // Get stat of the index
+    struct stat stat;
+    if(fstat(fd, &stat) != 0) {
+        printf("fstat failed\n");
+        close(fd);
+        exit(1);
+    }
+    if ((size_t)stat.st_size < sizeof(struct xidx_header)) {
+        close(fd);
+        die("index too short");
+    }
+
+    // Map the index to the virtual address space
+    char *map = mmap(NULL, stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        printf("mmap failed with errno %d\n", errno);
+        exit(1);
+    }
+
+    // Close file since we mapped
+    close(fd);
+
+    struct xidx x;
+    x.h = (struct xidx_header *)map;
+    if (x.h->magic != XIDX_MAGIC) {
+        die("not an xcheck index");
+    }
+    if (x.h->version != XIDX_VERSION) {
+        die("unsupported index version");
+    }
+    if (x.h->names + x.h->namesz > (uint64_t)stat.st_size) {
+        die("index truncated");
+    }
+    x.inodes = (struct xidx_inode *)(map + x.h->inodes);
+    x.blocks = (uint32_t *)(map + x.h->blocks);
+    x.owner = (uint32_t *)(map + x.h->owner);
+    x.bysize = (uint32_t *)(map + x.h->bysize);
+    x.dirents = (struct xidx_dirent *)(map + x.h->dirents);
+    x.names = map + x.h->names;
+
+    uint32_t arg = strtoul(argv[3], NULL, 0);
+    if (strcmp(argv[2], "inode") == 0) {
+        query_inode(&x, arg);
+    } else if (strcmp(argv[2], "owner") == 0) {
+        query_owner(&x, arg);
+    } else if (strcmp(argv[2], "larger") == 0) {
+        query_larger(&x, arg);
+    } else if (strcmp(argv[2], "ls") == 0) {
+        query_ls(&x, arg);
+    } else {
+        die("unknown query");
+    }
+
+    // Unmap
+    if (munmap(map, stat.st_size) != 0) {
+        printf("munmap failed with errno %d\n", errno);
+        exit(1);
+    }
+    return 0;
+}
@@ -17,9 +17,104 @@
 
 #define NAMESZ 64
 
+// Slot of the double-indirect block in the -d layout of xcheck, which gives
+// up the last direct address of the dinode of fs.h
+#define NADDRS (sizeof(((struct dinode *)0)->addrs) / sizeof(uint))
+#define DINDIRECT (NADDRS - 1)
+
 static uint test_counter = 0;
 static char testname[NAMESZ];
 
+// First indirect block of the double-indirect tree of a file, NULL if no file has one
+uint *first_dindirect(void *test_map) {
+    // Get the superblock
+    struct superblock *sb = (struct superblock *) ((char *)test_map + BSIZE);
+    // Get the inode_table which is a table of sb->ninodes many dinode
+    struct dinode *inode_table = (struct dinode *)((char *)test_map + sb->inodestart * BSIZE);
+    for (uint i = 1; i < sb->ninodes; ++i) {
+        struct dinode *inode = &inode_table[i];
+        if (inode->type == T_FILE && inode->addrs[DINDIRECT] != 0) {
+            uint *l1 = (uint *) ((char *)test_map + inode->addrs[DINDIRECT] * BSIZE);
+            for (uint j = 0; j < NINDIRECT; ++j) {
+                if (l1[j] != 0) {
+                    return (uint *) ((char *)test_map + l1[j] * BSIZE);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// ERROR: inode size does not match allocated blocks
+void test27(void *test_map) {
+    uint *indirect_addrs = first_dindirect(test_map);
+    if (indirect_addrs) {
+        indirect_addrs[0] = 0;
+    }
+}
+
+// ERROR: indirect address used more than once
+void test26(void *test_map) {
+    uint *indirect_addrs = first_dindirect(test_map);
+    if (indirect_addrs) {
+        indirect_addrs[1] = indirect_addrs[0];
+    }
+}
+
+// ERROR: bad indirect address in inode
+void test25(void *test_map) {
+    struct superblock *sb = (struct superblock *) ((char *)test_map + BSIZE);
+    uint *indirect_addrs = first_dindirect(test_map);
+    if (indirect_addrs) {
+        indirect_addrs[0] = sb->size + 1;
+    }
+}
+
+// ERROR: bad direct address in inode
+// An address that wraps around when the end of its block is computed in 32
+// bits, for the paths that read blocks before checking them (-c, --chain)
+void test24(void *test_map) {
+    // Get the superblock
+    struct superblock *sb = (struct superblock *) ((char *)test_map + BSIZE);
+    // Get the inode_table which is a table of sb->ninodes many dinode
+    struct dinode *inode_table = (struct dinode *)((char *)test_map + sb->inodestart * BSIZE);
+    inode_table[ROOTINO].addrs[1] = 0xFFFFFFFF;
+}
+
+// ERROR: directory not properly formatted
+void test23(void *test_map) {
+    // Get the superblock
+    struct superblock *sb = (struct superblock *) ((char *)test_map + BSIZE);
+    // Get the inode_table which is a table of sb->ninodes many dinode
+    struct dinode *inode_table = (struct dinode *)((char *)test_map + sb->inodestart * BSIZE);
+    for (uint i = ROOTINO + 1; i < sb->ninodes; ++i) {
+        struct dinode *inode = &inode_table[i];
+        if (inode->type == T_DIR && inode->addrs[0] != 0) {
+            struct dirent *dirents = (struct dirent *)((char*) test_map + (inode->addrs[0] * BSIZE));
+            for (uint k = 0; k < BSIZE / sizeof(struct dirent); ++k) {
+                if (strcmp(dirents[k].name, "..") == 0) {
+                    dirents[k].inum = sb->ninodes + 1;
+                    return;
+                }
+            }
+        }
+    }
+}
+
+// ERROR: inode size does not match allocated blocks
+void test22(void *test_map) {
+    // Get the superblock
+    struct superblock *sb = (struct superblock *) ((char *)test_map + BSIZE);
+    // Get the inode_table which is a table of sb->ninodes many dinode
+    struct dinode *inode_table = (struct dinode *)((char *)test_map + sb->inodestart * BSIZE);
+    for (uint i = 1; i < sb->ninodes; ++i) {
+        if (inode_table[i].type == T_FILE) {
+            inode_table[i].size += BSIZE;
+            return;
+        }
+    }
+}
+
 // ERROR: directory appears more than once in file system
 void test21(void *test_map) {
     // Get the superblock
@@ -421,7 +516,7 @@ void *create_test_file(void *map, off_t size) {
     return test_map;
 }
 
-void xtest(void *map, off_t size) {
+void xtest(void *map, off_t size, int dindirect) {
 
     void *test_map = create_test_file(map, size);
     test1(test_map);
@@ -507,19 +602,50 @@ void xtest(void *map, off_t size) {
     test21(test_map);
     munmap(test_map, size);
 
+    test_map = create_test_file(map, size);
+    test22(test_map);
+    munmap(test_map, size);
+
+    test_map = create_test_file(map, size);
+    test23(test_map);
+    munmap(test_map, size);
+
+    test_map = create_test_file(map, size);
+    test24(test_map);
+    munmap(test_map, size);
+
+    // Double-indirect trees exist only in images of the -d layout
+    if (dindirect) {
+        test_map = create_test_file(map, size);
+        test25(test_map);
+        munmap(test_map, size);
+
+        test_map = create_test_file(map, size);
+        test26(test_map);
+        munmap(test_map, size);
+
+        test_map = create_test_file(map, size);
+        test27(test_map);
+        munmap(test_map, size);
+    }
+
     munmap(map, size);
 }
 
 int main(int argc, char *argv[]) {
 
+    // -d: the image has the -d layout of xcheck, also corrupt its
+    // double-indirect trees
+    int dindirect = argc == 3 && strcmp(argv[1], "-d") == 0;
+
     // Validate number of args
-    if (argc != 2) {
-        printf("usage: xtest [valid xv6 filesystem image]\n");
+    if (argc != 2 + dindirect) {
+        printf("usage: xtest [-d] [valid xv6 filesystem image]\n");
         exit(1);
     }
 
     // Open the filesystem image
-    char *fs_img = argv[1];
+    char *fs_img = argv[1 + dindirect];
     int fd = open(fs_img, O_RDONLY);
     if (fd == -1) {
         printf("file open failed with errno %d\n", errno);
@@ -545,8 +671,14 @@ int main(int argc, char *argv[]) {
     // Close file since we mapped
     close(fd);
 
+    // The double-indirect tests would leave an image without such a file clean
+    if (dindirect && first_dindirect(file_map) == NULL) {
+        munmap(file_map, stat.st_size);
+        die("no file with a double-indirect block in image");
+    }
+
     // Core
-    xtest(file_map, stat.st_size);
+    xtest(file_map, stat.st_size, dindirect);
 
     // Unmap
     if (munmap(file_map, stat.st_size) != 0) {